@@ -1,25 +1,53 @@
-// c++ -std=c++1y -O2 bktree.cc -o bktree
+// c++ -std=c++1y -O2 -pthread bktree.cc -o bktree
 
 #include <algorithm>
+#include <cctype>
 #include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <random>
 #include <string>
+#include <thread>
 #include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define BKTREE_X86 1
+#include <immintrin.h>
+#endif
 using namespace std;
 
 namespace {
 
 struct StringRef {
   StringRef(const string& s) : s_(s.data()), n_(s.size()) {}
+  StringRef(const char* s, size_t n) : s_(s), n_(n) {}
   const char* s_;
   size_t n_;
 
   string AsString() const { return string(s_, n_); }
 };
 
+// Scratch space for one DP row, per thread. It only grows, so the distance
+// functions don't allocate once a thread has seen its longest word, and
+// unlike a variable-length array, a very long word can't overflow the stack.
+int* dp_row(size_t size) {
+  thread_local vector<int> row;
+  if (row.size() < size)
+    row.resize(size);
+  return row.data();
+}
+
 // The algorithm implemented below is the "classic"
 // dynamic-programming algorithm for computing the Levenshtein
 // distance, which is described here:
@@ -28,15 +56,15 @@ struct StringRef {
 //
 // Although the algorithm is typically described using an m x n
 // array, only one row plus one element are used at a time, so this
-// implementation just keeps one vector for the row.  To update one entry,
-// only the entries to the left, top, and top-left are needed.  The left
-// entry is in Row[x-1], the top entry is what's in Row[x] from the last
-// iteration, and the top-left entry is stored in Previous.
-int edit_distance(const StringRef& s1, const StringRef& s2) {
+// implementation just keeps one vector for the row, from dp_row().  To
+// update one entry, only the entries to the left, top, and top-left are
+// needed.  The left entry is in Row[x-1], the top entry is what's in Row[x]
+// from the last iteration, and the top-left entry is stored in Previous.
+int edit_distance_dp(const StringRef& s1, const StringRef& s2) {
   int m = s1.n_, n = s2.n_;
 
-  int row[n + 1];
-  for (int i = 1; i <= n; ++i)
+  int* row = dp_row(n + 1);
+  for (int i = 0; i <= n; ++i)
     row[i] = i;
 
   for (int y = 1; y <= m; ++y) {
@@ -53,11 +81,11 @@ int edit_distance(const StringRef& s1, const StringRef& s2) {
 }
 
 // Same, but with an early exit given an upper bound for the result.
-int edit_distance_bound(StringRef s1, StringRef s2, int upper_bound) {
+int edit_distance_bound_dp(StringRef s1, StringRef s2, int upper_bound) {
   int m = s1.n_, n = s2.n_;
 
-  int row[n + 1];
-  for (int i = 1; i <= n; ++i)
+  int* row = dp_row(n + 1);
+  for (int i = 0; i <= n; ++i)
     row[i] = i;
 
   for (int y = 1; y <= m; ++y) {
@@ -76,41 +104,471 @@ int edit_distance_bound(StringRef s1, StringRef s2, int upper_bound) {
   return row[n];
 }
 
+// Myers' bit-vector algorithm, in Hyyrö's formulation for Levenshtein
+// distance ("Explaining and Extending the Bit-parallel Approximate String
+// Matching Algorithm of Myers", 2001). Instead of one DP entry per step, it
+// keeps the differences between vertically adjacent entries of the current
+// column as two bit vectors, +1 (vp) and -1 (vn), one bit per character of
+// the pattern s1, and updates a whole column with a few word operations per
+// character of s2. score tracks the last entry, the distance so far.
+//
+// s1 must have at most 64 characters. Returns upper_bound + 1 as soon as the
+// distance is known to be larger than upper_bound: each remaining character
+// of s2 can lower the score by at most 1.
+int edit_distance_bits(StringRef s1, StringRef s2, int upper_bound = INT_MAX) {
+  int m = s1.n_, n = s2.n_;
+  if (m == 0)
+    return n;
+  if (upper_bound < INT_MAX && abs(m - n) > upper_bound)
+    return upper_bound + 1;
+
+  // peq[c] has bit i set if s1[i] == c. Kept zeroed between calls.
+  thread_local uint64_t peq[256];
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(s1.s_);
+  const unsigned char* t = reinterpret_cast<const unsigned char*>(s2.s_);
+  for (int i = 0; i < m; ++i)
+    peq[p[i]] |= uint64_t{1} << i;
+
+  uint64_t vp = ~uint64_t{0}, vn = 0, last = uint64_t{1} << (m - 1);
+  int score = m;
+  for (int j = 0; j < n; ++j) {
+    uint64_t eq = peq[t[j]];
+    uint64_t xv = eq | vn;
+    uint64_t xh = (((eq & vp) + vp) ^ vp) | eq;
+    uint64_t hp = vn | ~(xh | vp);
+    uint64_t hn = vp & xh;
+    score += (hp & last) != 0;  // Branch-free, these are unpredictable.
+    score -= (hn & last) != 0;
+    if (score - (n - j - 1) > upper_bound) {
+      score = upper_bound + 1;
+      break;
+    }
+    hp = (hp << 1) | 1;  // The top row is 0, 1, 2, ...: always +1.
+    hn <<= 1;
+    vp = hn | ~(xv | hp);
+    vn = hp & xv;
+  }
+
+  for (int i = 0; i < m; ++i)
+    peq[p[i]] = 0;
+  return score;
+}
+
+// Uses the bit-vector kernel if either word fits into 64 bits.
+int edit_distance(const StringRef& s1, const StringRef& s2) {
+  if (s1.n_ <= 64 || s2.n_ <= 64)
+    return s1.n_ <= s2.n_ ? edit_distance_bits(s1, s2)
+                          : edit_distance_bits(s2, s1);
+  return edit_distance_dp(s1, s2);
+}
+
+int edit_distance_bound(StringRef s1, StringRef s2, int upper_bound) {
+  if (s1.n_ <= 64 || s2.n_ <= 64)
+    return s1.n_ <= s2.n_ ? edit_distance_bits(s1, s2, upper_bound)
+                          : edit_distance_bits(s2, s1, upper_bound);
+  return edit_distance_bound_dp(s1, s2, upper_bound);
+}
+
+// Damerau-Levenshtein distance: like edit_distance(), but swapping two
+// adjacent characters costs 1, too ("teh" -> "the"). This is the unrestricted
+// distance (Lowrance and Wagner, 1975), which allows edits between swapped
+// characters: "ca" -> "ac" -> "abc" is 2. The cheaper "optimal string
+// alignment" distance doesn't, and says 3, so it breaks the triangle
+// inequality that BK-trees depend on.
+//
+// This needs the whole matrix, not one row. Returns upper_bound + 1 once a
+// row's minimum is over upper_bound, as edit_distance_bound_dp() does: row
+// minimums never go down here either.
+int damerau_distance(StringRef s1, StringRef s2, int upper_bound = INT_MAX) {
+  int m = s1.n_, n = s2.n_;
+  if (upper_bound < INT_MAX && abs(m - n) > upper_bound)
+    return upper_bound + 1;
+
+  // Rows and columns start at -1, which are out of reach.
+  int width = n + 2, unreachable = m + n;
+  thread_local vector<int> matrix;
+  matrix.resize((m + 2) * width);
+  auto at = [&](int y, int x) -> int& {
+    return matrix[(y + 1) * width + x + 1];
+  };
+  for (int y = -1; y <= m; ++y)
+    at(y, -1) = unreachable;
+  for (int x = 0; x <= n; ++x) {
+    at(-1, x) = unreachable;
+    at(0, x) = x;
+  }
+
+  int last_row[256] = {};  // Last row y so far with s1[y - 1] == c.
+  for (int y = 1; y <= m; ++y) {
+    unsigned char a = s1.s_[y - 1];
+    int best_this_row = at(y, 0) = y;
+    int last_column = 0;  // Last column x so far with s2[x - 1] == a.
+    for (int x = 1; x <= n; ++x) {
+      unsigned char b = s2.s_[x - 1];
+      int k = last_row[b], l = last_column;
+      int cost = a == b ? 0 : 1;
+      if (a == b)
+        last_column = x;
+      // Swap s1[k - 1] and s2[l - 1], and delete and insert everything in
+      // between.
+      int d = min(min(at(y - 1, x - 1) + cost, at(y - 1, x) + 1),
+                  min(at(y, x - 1) + 1,
+                      at(k - 1, l - 1) + (y - k - 1) + 1 + (x - l - 1)));
+      at(y, x) = d;
+      best_this_row = min(best_this_row, d);
+    }
+    if (best_this_row > upper_bound)
+      return upper_bound + 1;
+    last_row[a] = y;
+  }
+
+  return at(m, n);
+}
+
+// Weighted edit distance for typing errors on a qwerty keyboard. Replacing a
+// letter with one on the same or a neighboring key costs 1; other
+// replacements, insertions and deletions cost 2. Replacing never costs more
+// than deleting and inserting, and 1 + 1 >= 2, so this is still a metric.
+// Distances are in these units: n = 2 finds one arbitrary typo, or two near
+// misses.
+class Keyboard {
+  uint8_t key_[256];  // 1 + index of the key of c, 0 for other characters.
+  uint32_t near_[27];  // Bit j of near_[i]: keys i and j are at most 1 apart.
+
+  Keyboard() : key_(), near_() {
+    // Keys are 4 units wide, and the rows are shifted by 0, 1 and 3 units.
+    const char* rows[] = { "qwertyuiop", "asdfghjkl", "zxcvbnm" };
+    const int shift[] = { 0, 1, 3 };
+    int x[27], y[27], keys = 0;
+    for (int row = 0; row < 3; ++row) {
+      for (int i = 0; rows[row][i]; ++i) {
+        ++keys;
+        key_[uint8_t(rows[row][i])] = key_[uint8_t(toupper(rows[row][i]))] =
+            keys;
+        x[keys] = 4 * i + shift[row];
+        y[keys] = row;
+      }
+    }
+    for (int i = 1; i <= keys; ++i)
+      for (int j = 1; j <= keys; ++j)
+        if (abs(y[i] - y[j]) <= 1 && abs(x[i] - x[j]) <= 4)
+          near_[i] |= uint32_t{1} << j;
+  }
+
+ public:
+  static int replace_cost(unsigned char a, unsigned char b) {
+    static const Keyboard keyboard;
+    if (a == b)
+      return 0;
+    int i = keyboard.key_[a], j = keyboard.key_[b];
+    return i && (keyboard.near_[i] >> j & 1) ? 1 : 2;
+  }
+
+  static const int kInsertCost = 2;
+};
+
+// edit_distance_bound_dp() with these costs.
+int keyboard_distance(StringRef s1, StringRef s2, int upper_bound = INT_MAX) {
+  int m = s1.n_, n = s2.n_;
+  const int indel = Keyboard::kInsertCost;
+  if (upper_bound < INT_MAX && indel * abs(m - n) > upper_bound)
+    return upper_bound + 1;
+
+  int* row = dp_row(n + 1);
+  for (int i = 0; i <= n; ++i)
+    row[i] = indel * i;
+
+  for (int y = 1; y <= m; ++y) {
+    int best_this_row = row[0] = indel * y;
+    for (int x = 1, previous = indel * (y - 1); x <= n; ++x) {
+      int old_row = row[x];
+      row[x] = min(previous + Keyboard::replace_cost(s1.s_[y - 1],
+                                                     s2.s_[x - 1]),
+                   min(row[x - 1], row[x]) + indel);
+      previous = old_row;
+      best_this_row = min(best_this_row, row[x]);
+    }
+    if (best_this_row > upper_bound)
+      return upper_bound + 1;
+  }
+
+  return row[n];
+}
+
+// The number of positions at which the words differ, plus the difference in
+// their lengths. For fixed-length codes such as perceptual image hashes,
+// written as one character per bit or per digit.
+int hamming_distance(StringRef s1, StringRef s2, int upper_bound = INT_MAX) {
+  size_t common = min(s1.n_, s2.n_);
+  int d = max(s1.n_, s2.n_) - common;
+  for (size_t i = 0; i < common && d <= upper_bound; ++i)
+    d += s1.s_[i] != s2.s_[i];
+  return d;
+}
+
+// Metrics for BasicBkTree. distance_bound() returns the distance if it is
+// at most upper_bound, and some larger number otherwise. Each tree calls
+// its metric's functions directly, so they get inlined into the tree's
+// loops. kFileTag marks saved trees, so that a tree isn't loaded with the
+// wrong metric.
+struct Levenshtein {
+  static const char kFileTag = 0;
+  static int distance(StringRef a, StringRef b) { return edit_distance(a, b); }
+  static int distance_bound(StringRef a, StringRef b, int upper_bound) {
+    return edit_distance_bound(a, b, upper_bound);
+  }
+};
+
+struct Damerau {
+  static const char kFileTag = 'd';
+  static int distance(StringRef a, StringRef b) {
+    return damerau_distance(a, b);
+  }
+  static int distance_bound(StringRef a, StringRef b, int upper_bound) {
+    return damerau_distance(a, b, upper_bound);
+  }
+};
+
+struct KeyboardWeighted {
+  static const char kFileTag = 'k';
+  static int distance(StringRef a, StringRef b) {
+    return keyboard_distance(a, b);
+  }
+  static int distance_bound(StringRef a, StringRef b, int upper_bound) {
+    return keyboard_distance(a, b, upper_bound);
+  }
+};
+
+struct Hamming {
+  static const char kFileTag = 'h';
+  static int distance(StringRef a, StringRef b) {
+    return hamming_distance(a, b);
+  }
+  static int distance_bound(StringRef a, StringRef b, int upper_bound) {
+    return hamming_distance(a, b, upper_bound);
+  }
+};
+
+// Words grouped by length and transposed into batches of kLanes words, so
+// that one query can be compared against a whole batch at once: the DP from
+// edit_distance_dp(), on one word per byte lane. Since all words in a batch
+// have the same length, all lanes finish together, and batches with lengths
+// too far from the query's are skipped without looking at them.
+class WordBatches {
+ public:
+  static const int kLanes = 32;
+  static const int kMaxLength = 254;  // Distances must fit in a byte.
+
+  explicit WordBatches(const vector<string>& words) {
+    vector<StringRef> sorted;
+    for (auto&& word : words) {
+      if (word.size() <= kMaxLength)
+        sorted.push_back(word);
+      else
+        long_words_.push_back(word);
+    }
+    stable_sort(sorted.begin(), sorted.end(),
+                [](StringRef a, StringRef b) { return a.n_ < b.n_; });
+    for (size_t i = 0; i < sorted.size();) {
+      Batch batch;
+      batch.length = sorted[i].n_;
+      batch.chars = chars_.size();
+      batch.first_word = words_.size();
+      batch.count = 0;
+      chars_.resize(chars_.size() + batch.length * kLanes);
+      for (; batch.count < kLanes && i < sorted.size() &&
+             sorted[i].n_ == size_t(batch.length); ++batch.count, ++i) {
+        for (int x = 0; x < batch.length; ++x)
+          chars_[batch.chars + x * kLanes + batch.count] = sorted[i].s_[x];
+        words_.push_back(sorted[i]);
+      }
+      batches_.push_back(batch);
+    }
+  }
+
+  // Calls found(word) for each word within distance n of query.
+  template <class Found>
+  void query(StringRef query, int n, Found found) const {
+    for (auto&& word : long_words_)
+      if (edit_distance_bound(word, query, n) <= n)
+        found(word);
+    if (query.n_ > kMaxLength || n >= kMaxLength) {
+      for (auto&& word : words_)
+        if (edit_distance_bound(word, query, n) <= n)
+          found(word);
+      return;
+    }
+    // Words that differ in length by more than n are further than n apart.
+    int m = query.n_;
+    auto batch = lower_bound(
+        batches_.begin(), batches_.end(), m - n,
+        [](const Batch& b, int length) { return b.length < length; });
+    for (; batch != batches_.end() && batch->length <= m + n; ++batch) {
+      uint32_t lanes = within(&chars_[batch->chars], batch->length, query, n);
+      if (batch->count < kLanes)
+        lanes &= (uint32_t{1} << batch->count) - 1;
+      for (; lanes; lanes &= lanes - 1)
+        found(words_[batch->first_word + __builtin_ctz(lanes)]);
+    }
+  }
+
+ private:
+  struct Batch {
+    uint32_t chars;  // Offset into chars_; length rows of kLanes bytes.
+    uint32_t first_word;  // Index into words_.
+    int length, count;
+  };
+  vector<Batch> batches_;  // Sorted by length.
+  vector<uint8_t> chars_;  // chars_[batch.chars + x * kLanes + lane]
+  vector<StringRef> words_;
+  vector<StringRef> long_words_;  // Longer than kMaxLength, not batched.
+
+  // Returns a mask of the lanes whose word is within n of query.
+  static uint32_t within(const uint8_t* chars, int length, StringRef query,
+                         int n) {
+#ifdef BKTREE_X86
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2)
+      return within_avx2(chars, length, query, n);
+    return within_sse2(chars, length, query, n) |
+           within_sse2(chars + 16, length, query, n) << 16;
+#else
+    uint32_t lanes = 0;
+    char word[kMaxLength];
+    for (int lane = 0; lane < kLanes; ++lane) {
+      for (int x = 0; x < length; ++x)
+        word[x] = chars[x * kLanes + lane];
+      if (edit_distance_bound(StringRef(word, length), query, n) <= n)
+        lanes |= uint32_t{1} << lane;
+    }
+    return lanes;
+#endif
+  }
+
+#ifdef BKTREE_X86
+  // The DP runs down one column per character of the words, with a vector of
+  // kLanes (AVX2) or 16 (SSE2) distances per query character. Saturating byte
+  // adds keep distances at 255 at most. Like edit_distance_bound_dp(), stops
+  // once every lane's column minimum is over n: that never goes down again.
+  __attribute__((target("avx2")))
+  static uint32_t within_avx2(const uint8_t* chars, int length,
+                              StringRef query, int n) {
+    int m = query.n_;
+    __m256i col[kMaxLength + 1], q[kMaxLength];
+    const __m256i one = _mm256_set1_epi8(1), bound = _mm256_set1_epi8(n);
+    for (int y = 0; y <= m; ++y)
+      col[y] = _mm256_set1_epi8(y);
+    for (int y = 0; y < m; ++y)
+      q[y] = _mm256_set1_epi8(query.s_[y]);
+    for (int x = 1; x <= length; ++x) {
+      __m256i c = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i*>(chars + (x - 1) * kLanes));
+      __m256i diag = col[0];
+      __m256i low = col[0] = _mm256_set1_epi8(x);
+      for (int y = 1; y <= m; ++y) {
+        __m256i cost = _mm256_andnot_si256(_mm256_cmpeq_epi8(c, q[y - 1]), one);
+        __m256i v = _mm256_min_epu8(
+            _mm256_adds_epu8(diag, cost),
+            _mm256_adds_epu8(_mm256_min_epu8(col[y - 1], col[y]), one));
+        diag = col[y];
+        col[y] = v;
+        low = _mm256_min_epu8(low, v);
+      }
+      if (!_mm256_movemask_epi8(
+              _mm256_cmpeq_epi8(_mm256_max_epu8(low, bound), bound)))
+        return 0;
+    }
+    return _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_min_epu8(col[m], bound), col[m]));
+  }
+
+  // Same for 16 lanes; the rows of chars are still kLanes bytes apart.
+  static uint32_t within_sse2(const uint8_t* chars, int length,
+                              StringRef query, int n) {
+    int m = query.n_;
+    __m128i col[kMaxLength + 1], q[kMaxLength];
+    const __m128i one = _mm_set1_epi8(1), bound = _mm_set1_epi8(n);
+    for (int y = 0; y <= m; ++y)
+      col[y] = _mm_set1_epi8(y);
+    for (int y = 0; y < m; ++y)
+      q[y] = _mm_set1_epi8(query.s_[y]);
+    for (int x = 1; x <= length; ++x) {
+      __m128i c = _mm_loadu_si128(
+          reinterpret_cast<const __m128i*>(chars + (x - 1) * kLanes));
+      __m128i diag = col[0];
+      __m128i low = col[0] = _mm_set1_epi8(x);
+      for (int y = 1; y <= m; ++y) {
+        __m128i cost = _mm_andnot_si128(_mm_cmpeq_epi8(c, q[y - 1]), one);
+        __m128i v = _mm_min_epu8(
+            _mm_adds_epu8(diag, cost),
+            _mm_adds_epu8(_mm_min_epu8(col[y - 1], col[y]), one));
+        diag = col[y];
+        col[y] = v;
+        low = _mm_min_epu8(low, v);
+      }
+      if (!_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(low, bound), bound)))
+        return 0;
+    }
+    return _mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_min_epu8(col[m], bound), col[m]));
+  }
+#endif
+};
+
 // Returns an empty vector on error.  This is just a toy program.
+// FrozenBkTree and VpTree store word sizes in 16 bits and word offsets in 32
+// bits, so words over 65535 bytes, or more than 4GB of words, are an error too.
 vector<string> read_words(const char* file) {
   ifstream input(file);
-  return vector<string>(istream_iterator<string>(input),
-                        istream_iterator<string>());
+  vector<string> words(istream_iterator<string>(input),
+                       istream_iterator<string>{});
+  uint64_t total = 0;
+  for (const string& word : words) {
+    total += word.size();
+    if (word.size() > UINT16_MAX || total > UINT32_MAX) {
+      cerr << "Words too long for the flat indexes" << endl;
+      return vector<string>();
+    }
+  }
+  return words;
 }
 
 // See http://blog.notdot.net/2007/4/Damn-Cool-Algorithms-Part-1-BK-Trees
-class BkTree {
+template <class Metric>
+class BasicBkTree {
   StringRef value;
-  using Edges = map<int, unique_ptr<BkTree>>;
+  using Edges = map<int, unique_ptr<BasicBkTree>>;
   Edges children;
 
+  template <class> friend class BasicFrozenBkTree;
+
  public:
-  BkTree(StringRef value) : value(value) {}
+  BasicBkTree(StringRef value) : value(value) {}
+
+  // Builds the same tree as inserting words in order into
+  // BasicBkTree(words[0]), on threads threads. words must not be empty.
+  static unique_ptr<BasicBkTree> build(const vector<string>& words,
+                                       int threads);
 
   void insert(StringRef word) {
-    int d = edit_distance(value, word);
+    int d = Metric::distance(value, word);
     const auto& it = children.find(d);
     if (it == children.end())
-      children[d] = make_unique<BkTree>(word);
+      children[d] = make_unique<BasicBkTree>(word);
     else
       it->second->insert(word);
   }
 
-  // Prints matches to stdout.
-  void query(StringRef word, int n, int* count) {
+  // Appends matches to results.
+  void query(StringRef word, int n, vector<StringRef>* results, int* count) {
     ++*count;
-    int d = edit_distance(value, word);
+    int d = Metric::distance(value, word);
     if (d <= n)
-      cout << value.AsString() << endl;
+      results->push_back(value);
     for (auto&& it = children.lower_bound(d - n),
              && end = children.upper_bound(d + n);
          it != end; ++it) {
-      it->second->query(word, n, count);
+      it->second->query(word, n, results, count);
     }
   }
 
@@ -131,77 +589,934 @@ class BkTree {
   }
 };
 
-}  // namespace
+using BkTree = BasicBkTree<Levenshtein>;
 
-int main(int argc, char* argv[]) {
-  bool use_index = true;
-  bool dump_dot = false;
-  const char* wordfile = "/usr/share/dict/words";
-  for (; argc > 1 && argv[1][0] == '-'; ++argv, --argc) {
-    if (strcmp(argv[1], "-b") == 0)  // Brute force mode
-      use_index = false;
-    else if(strcmp(argv[1], "-dot") == 0)
-      dump_dot = true;
-    else if(strcmp(argv[1], "-w") == 0) {
-      if (argc < 3) {
-        cerr << "-w needs wordfile argument" << endl;
-        return EXIT_FAILURE;
+// A BkTree flattened after all inserts. Each map hop in BkTree::query() is a
+// walk through red-black tree nodes and a separately allocated subtree; here
+// all nodes are in one array in BFS order, so the children of a node are a
+// contiguous range of nodes, sorted by their distance to the parent. All
+// words are copied into one arena.
+//
+// Neither array has pointers in it, so save() writes them to a file as they
+// are, and map_file() maps such a file and queries it in place: loading an
+// index costs an mmap() instead of reading the word list and inserting every
+// word again.
+template <class Metric>
+class BasicFrozenBkTree {
+  struct Node {
+    uint32_t word;  // Offset into words_. See read_words() for limits.
+    uint16_t word_size;
+    uint16_t distance;  // To the parent.
+    uint32_t first_child, num_children;
+  };
+
+  // File layout: this header, the nodes, then the words. The magic number is
+  // written in host byte order, so that a file from a machine with the other
+  // byte order is rejected instead of misread. Its last byte is the metric's
+  // kFileTag.
+  struct FileHeader {
+    uint64_t magic;
+    uint64_t num_nodes;
+    uint64_t words_size;
+  };
+  static const uint64_t kMagic = 0x31656572746b62ULL |  // "bktree1", LE
+                                 uint64_t(uint8_t(Metric::kFileTag)) << 56;
+
+  // Either filled by the constructor, or empty and nodes_ and words_ point
+  // into a mapped file.
+  vector<Node> node_storage_;
+  string word_storage_;
+  void* map_ = nullptr;
+  size_t map_size_ = 0;
+
+  const Node* nodes_;
+  size_t num_nodes_;
+  const char* words_;
+
+  StringRef word(const Node& node) const {
+    return StringRef(words_ + node.word, node.word_size);
+  }
+
+  BasicFrozenBkTree() {}
+
+ public:
+  explicit BasicFrozenBkTree(const BasicBkTree<Metric>& root) {
+    // Grows while looping.
+    vector<pair<const BasicBkTree<Metric>*, int>> order{{&root, 0}};
+    for (size_t i = 0; i < order.size(); ++i) {
+      const BasicBkTree<Metric>* tree = order[i].first;
+      Node node;
+      node.word = word_storage_.size();
+      node.word_size = tree->value.n_;
+      node.distance = order[i].second;
+      node.first_child = order.size();
+      node.num_children = tree->children.size();
+      for (auto&& it : tree->children)
+        order.emplace_back(it.second.get(), it.first);
+      word_storage_.append(tree->value.s_, tree->value.n_);
+      node_storage_.push_back(node);
+    }
+    nodes_ = node_storage_.data();
+    num_nodes_ = node_storage_.size();
+    words_ = word_storage_.data();
+  }
+
+  ~BasicFrozenBkTree() {
+    if (map_)
+      munmap(map_, map_size_);
+  }
+
+  BasicFrozenBkTree(const BasicFrozenBkTree&) = delete;
+  BasicFrozenBkTree& operator=(const BasicFrozenBkTree&) = delete;
+
+  // Returns null if file can't be mapped or wasn't written by save(). The
+  // nodes themselves aren't checked, the file is trusted to be intact.
+  static unique_ptr<BasicFrozenBkTree> map_file(const char* file) {
+    int fd = open(file, O_RDONLY);
+    if (fd < 0)
+      return nullptr;
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(FileHeader))
+      map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);  // The mapping stays valid.
+    if (map == MAP_FAILED)
+      return nullptr;
+
+    unique_ptr<BasicFrozenBkTree> tree(new BasicFrozenBkTree);
+    tree->map_ = map;
+    tree->map_size_ = st.st_size;
+    const FileHeader* header = static_cast<const FileHeader*>(map);
+    size_t max_nodes = (st.st_size - sizeof(FileHeader)) / sizeof(Node);
+    if (header->magic != kMagic || header->num_nodes == 0 ||
+        header->num_nodes > max_nodes ||
+        header->words_size != st.st_size - sizeof(FileHeader) -
+                              header->num_nodes * sizeof(Node))
+      return nullptr;
+    tree->nodes_ = reinterpret_cast<const Node*>(header + 1);
+    tree->num_nodes_ = header->num_nodes;
+    tree->words_ = reinterpret_cast<const char*>(tree->nodes_ +
+                                                 tree->num_nodes_);
+    return tree;
+  }
+
+  // Returns false on error.
+  bool save(const char* file) const {
+    ofstream output(file, ios::binary);
+    FileHeader header = { kMagic, num_nodes_, 0 };
+    header.words_size = nodes_[num_nodes_ - 1].word +
+                        nodes_[num_nodes_ - 1].word_size;
+    output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    output.write(reinterpret_cast<const char*>(nodes_),
+                 num_nodes_ * sizeof(Node));
+    output.write(words_, header.words_size);
+    return bool(output.flush());
+  }
+
+  size_t size() const { return num_nodes_; }
+  size_t bytes() const {
+    return num_nodes_ * sizeof(Node) + nodes_[num_nodes_ - 1].word +
+           nodes_[num_nodes_ - 1].word_size;
+  }
+
+  // Calls found(word) for each match, in the same order as BkTree::query(),
+  // with word pointing into the tree's arena. Once a thread has run a query,
+  // more queries on it only allocate if they need more room than any before:
+  // the stack of nodes to visit is kept per thread, like the scratch space
+  // of the distance functions. So found must not query a tree with the same
+  // metric itself.
+  template <class Found>
+  void query(StringRef query, int n, Found found, int* count) const {
+    thread_local vector<uint32_t> stack;
+    stack.assign(1, 0);
+    while (!stack.empty()) {
+      const Node& node = nodes_[stack.back()];
+      stack.pop_back();
+      ++*count;
+      // Children are only visited if their distance is at most d + n, and
+      // d itself only matters up to n: compute no more than needed.
+      int max_child = node.num_children
+          ? nodes_[node.first_child + node.num_children - 1].distance : 0;
+      int d = Metric::distance_bound(word(node), query, max_child + n);
+      if (d <= n)
+        found(word(node));
+      // Children with distance in [d - n, d + n], pushed last to first so
+      // that they're visited first to last.
+      const Node* first = nodes_ + node.first_child;
+      const Node* last = first + node.num_children;
+      auto by_distance = [](const Node& a, int d) { return a.distance < d; };
+      const Node* lo = lower_bound(first, last, d - n, by_distance);
+      const Node* hi = lower_bound(lo, last, d + n + 1, by_distance);
+      for (const Node* it = hi; it != lo; --it)
+        stack.push_back(it - 1 - nodes_);
+    }
+  }
+
+  // Appends matches to results, in the same order as BkTree::query().
+  void query(StringRef query, int n, vector<StringRef>* results,
+             int* count) const {
+    this->query(query, n, [results](StringRef word) {
+      results->push_back(word);
+    }, count);
+  }
+
+  // Appends the k words nearest to query, at most max_distance away, to
+  // results as (distance, word), nearest first. Every word in the subtree
+  // under a child edge of length e is exactly e away from the parent, so none
+  // can be nearer than |d - e|; subtrees are visited in order of that bound,
+  // and once k words are found, only nearer words are of interest. The search
+  // stops when no unvisited subtree can have any. Ties at the k-th distance
+  // are broken arbitrarily.
+  //
+  // The bounds are small integers, so the queue is a stack per bound instead
+  // of a heap: half the time per visited node, and since it keeps descending
+  // into the subtree it just found something in, it finds close words sooner.
+  void nearest(StringRef query, int k, int max_distance,
+               vector<pair<int, StringRef>>* results, int* count) const {
+    if (k <= 0)
+      return;
+    auto farther = [](const pair<int, StringRef>& a,
+                      const pair<int, StringRef>& b) {
+      return a.first < b.first;
+    };
+    // Per thread, like the stack in query().
+    thread_local vector<pair<int, StringRef>> best;  // Max-heap on distance.
+    best.clear();
+    int radius = max_distance;
+
+    // Subtrees to visit, by the lowest distance any word in them can have.
+    // Within a bucket, last in first out, which stays close to where the
+    // search just was.
+    thread_local vector<vector<uint32_t>> todo;
+    if (todo.size() < size_t(max_distance) + 1)
+      todo.resize(max_distance + 1);
+    for (int i = 0; i <= max_distance; ++i)
+      todo[i].clear();
+    todo[0].push_back(0);
+    for (int low = 0; low <= radius;) {
+      if (todo[low].empty()) {
+        ++low;
+        continue;
       }
-      wordfile = argv[2];
-      ++argv;
-      --argc;
+      const Node& node = nodes_[todo[low].back()];
+      todo[low].pop_back();
+      ++*count;
+      int max_child = node.num_children
+          ? nodes_[node.first_child + node.num_children - 1].distance : 0;
+      int d = Metric::distance_bound(word(node), query, max_child + radius);
+      if (d <= radius) {
+        best.emplace_back(d, word(node));
+        push_heap(best.begin(), best.end(), farther);
+        if (best.size() > size_t(k)) {
+          pop_heap(best.begin(), best.end(), farther);
+          best.pop_back();
+        }
+        if (best.size() == size_t(k))
+          radius = best.front().first - 1;
+      }
+      const Node* first = nodes_ + node.first_child;
+      const Node* last = first + node.num_children;
+      auto by_distance = [](const Node& a, int d) { return a.distance < d; };
+      const Node* lo = lower_bound(first, last, d - radius, by_distance);
+      const Node* hi = lower_bound(lo, last, d + radius + 1, by_distance);
+      for (const Node* it = hi; it != lo; --it)
+        todo[max(low, abs(d - (it - 1)->distance))].push_back(it - 1 - nodes_);
     }
+    sort_heap(best.begin(), best.end(), farther);
+    results->insert(results->end(), best.begin(), best.end());
   }
 
-  if (argc < 2 || argc > 3) {
-    cerr << "Usage: bktree [-w wordfile] [-dot] [-b] [n] query" << endl;
-    return EXIT_FAILURE;
+  // Finds some word within n of query, and stops there: sets *match to
+  // (distance, word). Returns false if there is none. Children whose distance
+  // to the parent is closest to d are visited first: their subtrees can have
+  // the nearest words.
+  bool first_match(StringRef query, int n, pair<int, StringRef>* match,
+                   int* count) const {
+    thread_local vector<uint32_t> stack;  // Like in query().
+    stack.assign(1, 0);
+    while (!stack.empty()) {
+      const Node& node = nodes_[stack.back()];
+      stack.pop_back();
+      ++*count;
+      int max_child = node.num_children
+          ? nodes_[node.first_child + node.num_children - 1].distance : 0;
+      int d = Metric::distance_bound(word(node), query, max_child + n);
+      if (d <= n) {
+        *match = make_pair(d, word(node));
+        return true;
+      }
+      // Push the children in [d - n, d + n] from the outside in, so that the
+      // ones closest to d are popped first.
+      const Node* first = nodes_ + node.first_child;
+      const Node* last = first + node.num_children;
+      auto by_distance = [](const Node& a, int d) { return a.distance < d; };
+      const Node* lo = lower_bound(first, last, d - n, by_distance);
+      const Node* hi = lower_bound(lo, last, d + n + 1, by_distance);
+      while (lo != hi) {
+        if (abs(d - lo->distance) > abs(d - (hi - 1)->distance))
+          stack.push_back(lo++ - nodes_);
+        else
+          stack.push_back(--hi - nodes_);
+      }
+    }
+    return false;
+  }
+};
+
+using FrozenBkTree = BasicFrozenBkTree<Levenshtein>;
+
+// Vantage-point tree (Yianilos, 1993). Each node splits the words below it
+// in half by their distance to its own word, the vantage point: the nearer
+// half goes inside, at most radius away, and the farther half outside, at
+// least radius away. Words at exactly the median distance can end up on
+// either side, which keeps the halves even when many distances are equal, as
+// they are for edit distances. Where a BK-tree node has a child per distance,
+// this tree stays balanced however the distances are spread. A query at
+// distance d from the vantage point only looks inside if d - n <= radius, and
+// outside if d + n >= radius. Flat like FrozenBkTree, in preorder.
+template <class Metric>
+class VpTree {
+  struct Node {
+    uint32_t word;  // Offset into words_. See read_words() for limits.
+    uint16_t word_size;
+    uint16_t radius;
+    uint32_t inside, outside;  // Index into nodes_, 0 for none.
+  };
+  vector<Node> nodes_;
+  string words_;
+
+  StringRef word(const Node& node) const {
+    return StringRef(words_.data() + node.word, node.word_size);
+  }
+
+ public:
+  explicit VpTree(const vector<string>& words) {
+    // (Distance to the current vantage point, word).
+    vector<pair<int, StringRef>> items;
+    for (auto&& word : words)
+      items.emplace_back(0, word);
+    auto by_distance = [](const pair<int, StringRef>& a,
+                          const pair<int, StringRef>& b) {
+      return a.first < b.first;
+    };
+    mt19937 rng(1);  // Random vantage points, but the same each time.
+
+    // Subtrees to build: items[begin, end), and the node that links to it.
+    struct Subtree {
+      size_t begin, end;
+      uint32_t parent;
+      bool outside;
+    };
+    vector<Subtree> todo{{0, items.size(), 0, false}};
+    while (!todo.empty()) {
+      Subtree subtree = todo.back();
+      todo.pop_back();
+      if (subtree.begin == subtree.end)
+        continue;
+      if (!nodes_.empty()) {
+        Node& parent = nodes_[subtree.parent];
+        (subtree.outside ? parent.outside : parent.inside) = nodes_.size();
+      }
+      swap(items[subtree.begin],
+           items[subtree.begin + rng() % (subtree.end - subtree.begin)]);
+      StringRef vantage_point = items[subtree.begin].second;
+      Node node;
+      node.word = words_.size();
+      node.word_size = vantage_point.n_;
+      node.radius = 0;
+      node.inside = node.outside = 0;
+      words_.append(vantage_point.s_, vantage_point.n_);
+
+      auto first = items.begin() + subtree.begin + 1;
+      auto last = items.begin() + subtree.end;
+      auto split = first;
+      if (first != last) {
+        for (auto it = first; it != last; ++it)
+          it->first = Metric::distance(vantage_point, it->second);
+        split = first + (last - first) / 2;
+        nth_element(first, split, last, by_distance);
+        node.radius = split->first;
+      }
+      uint32_t index = nodes_.size();
+      nodes_.push_back(node);
+      size_t middle = split - items.begin();
+      todo.push_back({middle, subtree.end, index, true});
+      todo.push_back({subtree.begin + 1, middle, index, false});
+    }
+  }
+
+  size_t size() const { return nodes_.size(); }
+  size_t bytes() const {
+    return nodes_.size() * sizeof(Node) + words_.size();
+  }
+
+  // Appends matches to results.
+  void query(StringRef query, int n, vector<StringRef>* results,
+             int* count) const {
+    if (nodes_.empty())
+      return;
+    thread_local vector<uint32_t> stack;  // Like in FrozenBkTree::query().
+    stack.assign(1, 0);
+    while (!stack.empty()) {
+      const Node& node = nodes_[stack.back()];
+      stack.pop_back();
+      ++*count;
+      // Past radius + n, only the outside is left.
+      int d = Metric::distance_bound(word(node), query, node.radius + n);
+      if (d <= n)
+        results->push_back(word(node));
+      if (node.outside && d + n >= node.radius)
+        stack.push_back(node.outside);
+      if (node.inside && d - n <= node.radius)
+        stack.push_back(node.inside);
+    }
+  }
+};
+
+// Words bucketed by length, with an inverted index of their bigrams, for
+// Levenshtein distance only. Words that differ in length by more than n are
+// skipped, like in WordBatches. Within a length, the count filter (Ukkonen,
+// 1992) skips most words without computing any distance: with '\0' padding
+// on both sides, a word has length + 1 bigrams, and one edit changes at most
+// 2 of them, so words within n of query share at least
+// max(length, query length) + 1 - 2n bigrams with it. Bigrams are counted
+// with multiplicity: the k-th occurrence of a bigram in a word is a
+// different token than the first one.
+class QGramIndex {
+  // Token keys: length << 32 | occurrence << 17 | bigram, where bigram is
+  // 257 * (first + 1) + second + 1 with padding as -1.
+  vector<uint64_t> keys_;  // Sorted.
+  vector<uint32_t> starts_;  // postings_[starts_[i], starts_[i + 1]).
+  vector<uint32_t> postings_;  // Indices into words_, ascending.
+  vector<StringRef> words_;  // Sorted by length.
+  vector<uint32_t> by_length_;  // Words of length l: [by_length_[l], [l + 1]).
+
+  // The bigram tokens of word, without the length.
+  static void tokens(StringRef word, vector<uint64_t>* out) {
+    out->clear();
+    const unsigned char* s = reinterpret_cast<const unsigned char*>(word.s_);
+    for (size_t i = 0; i <= word.n_; ++i) {
+      int first = i > 0 ? s[i - 1] + 1 : 0;
+      int second = i < word.n_ ? s[i] + 1 : 0;
+      out->push_back(257 * first + second);
+    }
+    sort(out->begin(), out->end());
+    const uint64_t kBigram = (1 << 17) - 1;
+    for (size_t i = 1, occurrence = 0; i < out->size(); ++i) {
+      bool repeat = (*out)[i] == ((*out)[i - 1] & kBigram);
+      occurrence = repeat ? occurrence + 1 : 0;
+      (*out)[i] |= uint64_t(occurrence) << 17;
+    }
+  }
+
+ public:
+  explicit QGramIndex(const vector<string>& words)
+      : words_(words.begin(), words.end()) {
+    stable_sort(words_.begin(), words_.end(),
+                [](StringRef a, StringRef b) { return a.n_ < b.n_; });
+    size_t max_length = words_.empty() ? 0 : words_.back().n_;
+    by_length_.assign(max_length + 2, 0);
+    for (auto&& word : words_)
+      ++by_length_[word.n_ + 1];
+    for (size_t l = 1; l < by_length_.size(); ++l)
+      by_length_[l] += by_length_[l - 1];
+
+    vector<pair<uint64_t, uint32_t>> all;
+    vector<uint64_t> word_tokens;
+    for (size_t i = 0; i < words_.size(); ++i) {
+      tokens(words_[i], &word_tokens);
+      for (uint64_t token : word_tokens)
+        all.emplace_back(uint64_t(words_[i].n_) << 32 | token, i);
+    }
+    sort(all.begin(), all.end());
+    for (size_t i = 0; i < all.size(); ++i) {
+      if (i == 0 || all[i].first != all[i - 1].first) {
+        keys_.push_back(all[i].first);
+        starts_.push_back(i);
+      }
+      postings_.push_back(all[i].second);
+    }
+    starts_.push_back(all.size());
+  }
+
+  size_t bytes() const {
+    size_t chars = 0;
+    for (auto&& word : words_)
+      chars += word.n_;
+    return keys_.size() * sizeof(keys_[0]) +
+           starts_.size() * sizeof(starts_[0]) +
+           postings_.size() * sizeof(postings_[0]) +
+           words_.size() * sizeof(words_[0]) +
+           by_length_.size() * sizeof(by_length_[0]) + chars;
+  }
+
+  // Appends matches to results, shortest words first. count is the number
+  // of words whose distance was computed.
+  void query(StringRef query, int n, vector<StringRef>* results,
+             int* count) const {
+    // Per thread, like the stack in FrozenBkTree::query().
+    thread_local vector<uint64_t> query_tokens;
+    thread_local vector<uint16_t> shared;
+    tokens(query, &query_tokens);
+    int m = query.n_;
+    int max_length = by_length_.size() - 2;
+    for (int l = max(0, m - n); l <= min(max_length, m + n); ++l) {
+      uint32_t begin = by_length_[l], end = by_length_[l + 1];
+      int need = max(m, l) + 1 - 2 * n;
+      if (need > 0) {
+        shared.assign(end - begin, 0);
+        for (uint64_t token : query_tokens) {
+          uint64_t key = uint64_t(l) << 32 | token;
+          auto it = lower_bound(keys_.begin(), keys_.end(), key);
+          if (it == keys_.end() || *it != key)
+            continue;
+          size_t i = it - keys_.begin();
+          for (uint32_t p = starts_[i]; p < starts_[i + 1]; ++p)
+            ++shared[postings_[p] - begin];
+        }
+      }
+      for (uint32_t i = begin; i < end; ++i) {
+        if (need > 0 && shared[i - begin] < need)
+          continue;
+        ++*count;
+        if (edit_distance_bound(words_[i], query, n) <= n)
+          results->push_back(words_[i]);
+      }
+    }
   }
+};
 
-  int n = argc == 3 ? atoi(argv[1]) : 2;
-  string query(argv[argc - 1]);
+// Hands out the indices 0 to size - 1 to workers. Each worker starts with
+// its own contiguous share and takes indices from the front of it. When its
+// share runs out, it steals the back half of another worker's share, so a
+// worker that drew slow items doesn't hold up the others.
+class WorkStealingRanges {
+  struct Range {
+    mutex lock;
+    size_t begin, end;
+    char padding[64];  // Keep the ranges of different workers apart.
+  };
+  vector<Range> ranges_;
 
-  const vector<string> words = read_words(wordfile);
+ public:
+  WorkStealingRanges(size_t size, int workers) : ranges_(workers) {
+    for (int i = 0; i < workers; ++i) {
+      ranges_[i].begin = size * i / workers;
+      ranges_[i].end = size * (i + 1) / workers;
+    }
+  }
+
+  // Returns false once there's nothing left to take or steal.
+  bool next(int worker, size_t* index) {
+    Range& own = ranges_[worker];
+    {
+      lock_guard<mutex> hold(own.lock);
+      if (own.begin < own.end) {
+        *index = own.begin++;
+        return true;
+      }
+    }
+    // Only one lock is held at a time. Work only ever moves into an empty
+    // range, whose owner then does it, so giving up after one pass over all
+    // victims never loses any.
+    int workers = ranges_.size();
+    for (int i = 1; i < workers; ++i) {
+      Range& victim = ranges_[(worker + i) % workers];
+      size_t begin, end;
+      {
+        lock_guard<mutex> hold(victim.lock);
+        if (victim.begin == victim.end)
+          continue;
+        end = victim.end;
+        begin = victim.end -= (end - victim.begin + 1) / 2;
+      }
+      lock_guard<mutex> hold(own.lock);
+      own.begin = begin + 1;
+      own.end = end;
+      *index = begin;
+      return true;
+    }
+    return false;
+  }
+};
+
+// Runs work(0) on this thread and work(1) to work(threads - 1) on new ones,
+// and waits for all of them.
+template <class Work>
+void run_on_threads(int threads, Work work) {
+  vector<thread> pool;
+  for (int i = 1; i < threads; ++i)
+    pool.emplace_back(work, i);
+  work(0);
+  for (auto&& t : pool)
+    t.join();
+}
+
+// Runs all queries against index on threads threads, and returns the
+// matches of queries[i] in results[i]. Index needs a const query() like
+// FrozenBkTree's, which is safe to call from several threads at once.
+template <class Index>
+vector<vector<StringRef>> query_batch(const Index& index,
+                                      const vector<StringRef>& queries, int n,
+                                      int threads) {
+  threads = max(threads, 1);
+  vector<vector<StringRef>> results(queries.size());
+  WorkStealingRanges ranges(queries.size(), threads);
+  run_on_threads(threads, [&](int worker) {
+    size_t i;
+    while (ranges.next(worker, &i)) {
+      int count = 0;
+      index.query(queries[i], n, &results[i], &count);
+    }
+  });
+  return results;
+}
+
+// Inserting a word only changes the subtree under the root's child at the
+// word's distance to the root, and the words in there arrive in the order
+// they were inserted. So the words can be split up by their distance to the
+// root, and each part inserted into its own subtree, independently of the
+// others. The largest part is split up again the same way, until there are
+// enough parts to keep all threads busy. The distances for a split are
+// computed on all threads, too.
+//
+// This is faster than inserting in order even on one thread: each part's
+// inserts only touch that part's subtree, which then stays in cache.
+template <class Metric>
+unique_ptr<BasicBkTree<Metric>> BasicBkTree<Metric>::build(
+    const vector<string>& words, int threads) {
+  const int kPartsPerThread = 16;
+  const size_t kMinSplit = 4096;  // Smaller parts aren't worth a split.
+  const size_t kChunk = 1024;  // Words per work item when splitting.
+  threads = max(threads, 1);
+
+  auto root = make_unique<BasicBkTree>(words[0]);
+  struct Part {
+    BasicBkTree* tree;  // Still without children.
+    vector<StringRef> words;  // To insert into tree, in this order.
+  };
+  vector<Part> parts(1);
+  parts[0].tree = root.get();
+  parts[0].words.assign(words.begin() + 1, words.end());
+
+  vector<int> distances;
+  while (parts.size() < size_t(threads * kPartsPerThread)) {
+    auto largest = max_element(parts.begin(), parts.end(),
+                               [](const Part& a, const Part& b) {
+                                 return a.words.size() < b.words.size();
+                               });
+    if (largest->words.size() < kMinSplit)
+      break;
+    swap(*largest, parts.back());
+    Part part = move(parts.back());
+    parts.pop_back();
+
+    distances.resize(part.words.size());
+    WorkStealingRanges chunks((part.words.size() + kChunk - 1) / kChunk,
+                              threads);
+    run_on_threads(threads, [&](int worker) {
+      size_t chunk;
+      while (chunks.next(worker, &chunk)) {
+        size_t end = min(part.words.size(), (chunk + 1) * kChunk);
+        for (size_t i = chunk * kChunk; i < end; ++i)
+          distances[i] = Metric::distance(part.tree->value, part.words[i]);
+      }
+    });
+
+    // The first word at each distance becomes the child, the others go into
+    // the part under it.
+    map<int, size_t> part_at_distance;
+    for (size_t i = 0; i < part.words.size(); ++i) {
+      auto it = part_at_distance.find(distances[i]);
+      if (it != part_at_distance.end()) {
+        parts[it->second].words.push_back(part.words[i]);
+        continue;
+      }
+      auto& child = part.tree->children[distances[i]];
+      child = make_unique<BasicBkTree>(part.words[i]);
+      part_at_distance[distances[i]] = parts.size();
+      parts.push_back(Part{child.get(), {}});
+    }
+  }
+
+  WorkStealingRanges ranges(parts.size(), threads);
+  run_on_threads(threads, [&](int worker) {
+    size_t i;
+    while (ranges.next(worker, &i))
+      for (auto&& word : parts[i].words)
+        parts[i].tree->insert(word);
+  });
+  return root;
+}
+
+// Runs one query on index and prints the matches and how long it took.
+template <class Index>
+void timed_query(Index& index, StringRef query, int n, size_t size) {
+  int count = 0;
+  vector<StringRef> results;
+  auto start_time = chrono::high_resolution_clock::now();
+  index.query(query, n, &results, &count);
+  auto end_time = chrono::high_resolution_clock::now();
+  for (auto&& result : results)
+    cout << result.AsString() << '\n';
+  cout << "Indexed query took "
+       << chrono::duration_cast<chrono::milliseconds>(end_time - start_time)
+              .count() << "ms" << endl;
+  cout << "Queried " << count << " (" << (100 * count / size) << "%)" << endl;
+}
+
+// Same for the frozen tree, which can also find the k nearest words within
+// n, or just the first one it comes across. Prints distances, too.
+template <class Metric>
+void timed_frozen_query(const BasicFrozenBkTree<Metric>& index,
+                        StringRef query, int n, int k, bool first,
+                        size_t size) {
+  if (k <= 0 && !first)
+    return timed_query(index, query, n, size);
+  int count = 0;
+  vector<pair<int, StringRef>> results(1, make_pair(0, query));
+  auto start_time = chrono::high_resolution_clock::now();
+  if (first) {
+    if (!index.first_match(query, n, &results[0], &count))
+      results.clear();
+  } else {
+    results.clear();
+    index.nearest(query, k, n, &results, &count);
+  }
+  auto end_time = chrono::high_resolution_clock::now();
+  for (auto&& result : results)
+    cout << result.second.AsString() << ' ' << result.first << '\n';
+  cout << "Indexed query took "
+       << chrono::duration_cast<chrono::milliseconds>(end_time - start_time)
+              .count() << "ms" << endl;
+  cout << "Queried " << count << " (" << (100 * count / size) << "%)" << endl;
+}
+
+struct Options {
+  bool use_index = true;
+  bool use_batches = false;
+  bool use_frozen = true;
+  bool dump_dot = false;
+  int nearest = 0;
+  int threads = 0;  // Insert one by one.
+  bool first_match = false;
+  const char* wordfile = "/usr/share/dict/words";
+  const char* load_file = nullptr;
+  const char* save_file = nullptr;
+  const char* index = "bk";  // Or "vp" or "qgram".
+  int n = 2;
+  string query;
+};
+
+// Everything after parsing the options, with the chosen metric.
+template <class Metric>
+int run(const Options& o) {
+  using BkTree = BasicBkTree<Metric>;
+  using FrozenBkTree = BasicFrozenBkTree<Metric>;
+  int n = o.n;
+  StringRef query = o.query;
+
+  // A saved index has all words in it, the word file isn't needed.
+  if (o.load_file) {
+    auto start_time = chrono::high_resolution_clock::now();
+    unique_ptr<FrozenBkTree> frozen = FrozenBkTree::map_file(o.load_file);
+    auto end_time = chrono::high_resolution_clock::now();
+    if (!frozen) {
+      cerr << "Could not load index " << o.load_file << endl;
+      return EXIT_FAILURE;
+    }
+    cout << "Index loading took "
+         << chrono::duration_cast<chrono::milliseconds>(end_time - start_time)
+                .count() << "ms (size: " << frozen->size() << ")" << endl;
+    timed_frozen_query(*frozen, query, n, o.nearest, o.first_match,
+                       frozen->size());
+    return EXIT_SUCCESS;
+  }
+
+  const vector<string> words = read_words(o.wordfile);
   if (words.empty())
     return EXIT_FAILURE;
 
-  if (use_index) {
+  if (o.use_index && strcmp(o.index, "vp") == 0) {
+    auto start_time = chrono::high_resolution_clock::now();
+    VpTree<Metric> index(words);
+    auto end_time = chrono::high_resolution_clock::now();
+    cout << "Index construction took "
+         << chrono::duration_cast<chrono::milliseconds>(end_time - start_time)
+                .count() << "ms" << endl;
+    timed_query(index, query, n, words.size());
+  } else if (o.use_index && strcmp(o.index, "qgram") == 0) {
+    // Levenshtein only, main() checks.
     auto start_time = chrono::high_resolution_clock::now();
-    BkTree index(words[0]);
-    for (size_t i = 1; i < words.size(); ++i)
-      index.insert(words[i]);
+    QGramIndex index(words);
+    auto end_time = chrono::high_resolution_clock::now();
+    cout << "Index construction took "
+         << chrono::duration_cast<chrono::milliseconds>(end_time - start_time)
+                .count() << "ms" << endl;
+    timed_query(index, query, n, words.size());
+  } else if (o.use_index) {
+    auto start_time = chrono::high_resolution_clock::now();
+    unique_ptr<BkTree> index;
+    if (o.threads > 0) {
+      index = BkTree::build(words, o.threads);
+    } else {
+      index = make_unique<BkTree>(words[0]);
+      for (size_t i = 1; i < words.size(); ++i)
+        index->insert(words[i]);
+    }
     auto end_time = chrono::high_resolution_clock::now();
 
-    if (dump_dot) {
+    if (o.dump_dot) {
       cout << "digraph G {" << endl;
-      index.dump_dot();
+      index->dump_dot();
       cout << "}" << endl;
     } else {
       cout << "Index construction took "
            << chrono::duration_cast<chrono::milliseconds>(end_time - start_time)
                   .count() << "ms" << endl;
-      cout << "Index depth: " << index.depth() << " (size: " << words.size()
+      cout << "Index depth: " << index->depth() << " (size: " << words.size()
            << ")" << endl;
 
-      int count = 0;
-      auto start_time = chrono::high_resolution_clock::now();
-      index.query(query, n, &count);
-      auto end_time = chrono::high_resolution_clock::now();
-      cout << "Indexed query took "
+      start_time = chrono::high_resolution_clock::now();
+      FrozenBkTree frozen(*index);
+      end_time = chrono::high_resolution_clock::now();
+      cout << "Index freezing took "
            << chrono::duration_cast<chrono::milliseconds>(end_time - start_time)
                   .count() << "ms" << endl;
-      cout << "Queried " << count << " (" << (100 * count / words.size())
-           << "%)" << endl;
+
+      if (o.save_file && !frozen.save(o.save_file)) {
+        cerr << "Could not save index " << o.save_file << endl;
+        return EXIT_FAILURE;
+      }
+
+      if (o.use_frozen)
+        timed_frozen_query(frozen, query, n, o.nearest, o.first_match,
+                           words.size());
+      else
+        timed_query(*index, query, n, words.size());
     }
+  } else if (o.use_batches) {  // Levenshtein only, main() checks.
+    auto start_time = chrono::high_resolution_clock::now();
+    WordBatches batches(words);
+    auto end_time = chrono::high_resolution_clock::now();
+    cout << "Batch construction took "
+         << chrono::duration_cast<chrono::milliseconds>(end_time - start_time)
+                .count() << "ms" << endl;
+
+    vector<StringRef> results;
+    start_time = chrono::high_resolution_clock::now();
+    batches.query(query, n, [&](StringRef word) { results.push_back(word); });
+    end_time = chrono::high_resolution_clock::now();
+    for (auto&& result : results)
+      cout << result.AsString() << '\n';
+    cout << "Vectorized brute force query took "
+         << chrono::duration_cast<chrono::milliseconds>(end_time - start_time)
+                .count() << "ms" << endl;
   } else {
+    vector<StringRef> results;
     auto start_time = chrono::high_resolution_clock::now();
     for (auto&& word : words) {
-      if (edit_distance_bound(word, query, n) <= n)
-        cout << word << endl;
+      if (Metric::distance_bound(word, query, n) <= n)
+        results.push_back(word);
     }
     auto end_time = chrono::high_resolution_clock::now();
+    for (auto&& result : results)
+      cout << result.AsString() << '\n';
     cout << "Brute force query took "
          << chrono::duration_cast<chrono::milliseconds>(end_time - start_time)
                 .count() << "ms" << endl;
   }
+  return EXIT_SUCCESS;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  Options o;
+  const char* metric = "levenshtein";
+  for (; argc > 1 && argv[1][0] == '-'; ++argv, --argc) {
+    if (strcmp(argv[1], "-b") == 0)  // Brute force mode
+      o.use_index = false;
+    else if (strcmp(argv[1], "-v") == 0)  // Vectorized brute force mode
+      o.use_index = false, o.use_batches = true;
+    else if (strcmp(argv[1], "-m") == 0)  // Query the map-based tree
+      o.use_frozen = false;
+    else if(strcmp(argv[1], "-dot") == 0)
+      o.dump_dot = true;
+    else if (strcmp(argv[1], "-first") == 0)  // Stop at the first match
+      o.first_match = true;
+    else if (strcmp(argv[1], "-k") == 0 ||  // The k nearest within n
+             strcmp(argv[1], "-j") == 0) {  // Build on this many threads
+      if (argc < 3) {
+        cerr << argv[1] << " needs count argument" << endl;
+        return EXIT_FAILURE;
+      }
+      if (argv[1][1] == 'k')
+        o.nearest = atoi(argv[2]);
+      else
+        o.threads = atoi(argv[2]);
+      ++argv;
+      --argc;
+    }
+    else if(strcmp(argv[1], "-w") == 0 || strcmp(argv[1], "-load") == 0 ||
+            strcmp(argv[1], "-save") == 0 || strcmp(argv[1], "-metric") == 0 ||
+            strcmp(argv[1], "-index") == 0) {
+      if (argc < 3) {
+        cerr << argv[1] << " needs argument" << endl;
+        return EXIT_FAILURE;
+      }
+      if (argv[1][1] == 'w')
+        o.wordfile = argv[2];
+      else if (argv[1][1] == 'l')
+        o.load_file = argv[2];
+      else if (argv[1][1] == 's')
+        o.save_file = argv[2];
+      else if (argv[1][1] == 'i')
+        o.index = argv[2];
+      else
+        metric = argv[2];
+      ++argv;
+      --argc;
+    }
+  }
+
+  if (argc < 2 || argc > 3) {
+    cerr << "Usage: bktree [-w wordfile] [-load indexfile] [-save indexfile] "
+            "[-metric levenshtein|damerau|keyboard|hamming] "
+            "[-index bk|vp|qgram] [-dot] [-b] [-v] [-m] [-k count] [-first] "
+            "[-j threads] [n] query" << endl;
+    return EXIT_FAILURE;
+  }
+  if ((o.nearest > 0 || o.first_match) && !o.use_frozen) {
+    cerr << "-k and -first don't work with -m" << endl;
+    return EXIT_FAILURE;
+  }
+  if (strcmp(o.index, "bk") != 0 && strcmp(o.index, "vp") != 0 &&
+      strcmp(o.index, "qgram") != 0) {
+    cerr << "Unknown index " << o.index << endl;
+    return EXIT_FAILURE;
+  }
+  if (strcmp(o.index, "bk") != 0 && (o.nearest > 0 || o.first_match)) {
+    cerr << "-k and -first only work with the bk index" << endl;
+    return EXIT_FAILURE;
+  }
+
+  if (argc == 3)
+    o.n = atoi(argv[1]);
+  o.query = argv[argc - 1];
+
+  if (strcmp(metric, "levenshtein") == 0)
+    return run<Levenshtein>(o);
+  if (o.use_batches || strcmp(o.index, "qgram") == 0) {
+    cerr << "-v and -index qgram only work with levenshtein" << endl;
+    return EXIT_FAILURE;
+  }
+  if (strcmp(metric, "damerau") == 0)
+    return run<Damerau>(o);
+  if (strcmp(metric, "keyboard") == 0)
+    return run<KeyboardWeighted>(o);
+  if (strcmp(metric, "hamming") == 0)
+    return run<Hamming>(o);
+  cerr << "Unknown metric " << metric << endl;
+  return EXIT_FAILURE;
 }
@@ -1,20 +1,38 @@
-// c++ -std=c++1y -O2 bktree_bench.cc -o bktree_bench
+// c++ -std=c++1y -O2 -pthread bktree_bench.cc -o bktree_bench
 
 // Benchmark tests for bktree.cc
 //
-#include <algorithm>
-#include <chrono>
-#include <fstream>
-#include <iostream>
-#include <map>
-#include <memory>
-#include <string>
-#include <vector>
-using namespace std;
+// Pull in bktree.cc, without its main.
+#define main bktree_main
+#include "bktree.cc"
+#undef main
+
+#include <atomic>
+#include <new>
+#include <random>
+
+// Counts heap allocations, for bench_allocations(). GCC flags the free()
+// once these are inlined into a new/delete pair.
+static atomic<long> allocations{0};
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void* operator new(size_t size) {
+  ++allocations;
+  if (void* p = malloc(size ? size : 1))
+    return p;
+  throw bad_alloc();
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+#pragma GCC diagnostic pop
 
 namespace {
 
-int edit_distance(const string& s1, const string& s2) {
+// Like edit_distance_dp() in bktree.cc, but with two rows instead of one row
+// and a variable.
+int edit_distance_two_rows(const string& s1, const string& s2) {
   int m = s1.size();
   int n = s2.size();
 
@@ -38,38 +56,290 @@ int edit_distance(const string& s1, const string& s2) {
   return previous[n];
 }
 
-// Returns an empty vector on error.  This is just a toy program.
-vector<string> read_words(const char* file) {
-  ifstream input(file);
-  return vector<string>(istream_iterator<string>(input),
-                        istream_iterator<string>());
+// Bounded kernels get this bound, a typical query distance.
+const int kBound = 2;
+
+struct Kernel {
+  const char* name;
+  int (*distance)(const string&, const string&);
+};
+
+const Kernel kKernels[] = {
+  { "dp, two rows", edit_distance_two_rows },
+  { "dp", [](const string& a, const string& b) {
+      return edit_distance_dp(a, b); } },
+  { "bit-parallel", [](const string& a, const string& b) {
+      return edit_distance(a, b); } },
+  { "dp, bound 2", [](const string& a, const string& b) {
+      return min(edit_distance_bound_dp(a, b, kBound), kBound + 1); } },
+  { "bit-parallel, bound 2", [](const string& a, const string& b) {
+      return min(edit_distance_bound(a, b, kBound), kBound + 1); } },
+};
+
+// Times each kernel on the same random words against random queries. Few
+// enough words to stay in cache, so this measures the kernels and not
+// memory latency.
+void bench_kernels(const vector<string>& words) {
+  const int kQueries = 100, kWords = 10000, kPairs = kQueries * kWords;
+  mt19937 rng(1);
+  vector<string> queries, sample;
+  for (int i = 0; i < kQueries; ++i)
+    queries.push_back(words[rng() % words.size()]);
+  for (int i = 0; i < kWords; ++i)
+    sample.push_back(words[rng() % words.size()]);
+
+  long expected = -1, expected_bound = -1;
+  for (auto&& kernel : kKernels) {
+    auto start_time = chrono::high_resolution_clock::now();
+    long sum = 0;
+    for (auto&& query : queries)
+      for (auto&& word : sample)
+        sum += kernel.distance(word, query);
+    auto end_time = chrono::high_resolution_clock::now();
+
+    // Bounded kernels have different sums.
+    long& want = strstr(kernel.name, "bound") ? expected_bound : expected;
+    if (want < 0)
+      want = sum;
+    double ns = chrono::duration_cast<chrono::nanoseconds>(end_time -
+                                                           start_time).count();
+    cout << kernel.name << ": " << ns / kPairs << "ns per pair"
+         << (sum == want ? "" : " MISMATCH") << endl;
+  }
+
+  // WordBatches only says which words are within the bound, so compare the
+  // number of matches.
+  long want = 0;
+  for (auto&& query : queries)
+    for (auto&& word : sample)
+      want += edit_distance_bound(word, query, kBound) <= kBound;
+  WordBatches batches(sample);
+  auto start_time = chrono::high_resolution_clock::now();
+  long matches = 0;
+  for (auto&& query : queries)
+    batches.query(query, kBound, [&](StringRef) { ++matches; });
+  auto end_time = chrono::high_resolution_clock::now();
+  double ns = chrono::duration_cast<chrono::nanoseconds>(end_time -
+                                                         start_time).count();
+  cout << "simd batches, bound 2: " << ns / kPairs << "ns per pair"
+       << (matches == want ? "" : " MISMATCH") << endl;
 }
 
-// See http://blog.notdot.net/2007/4/Damn-Cool-Algorithms-Part-1-BK-Trees
-class BkTree {
-  const string* value;  // Not owned!
-  using Edges = map<int, unique_ptr<BkTree>>;
-  Edges children;
-
- public:
-  BkTree(const string* value) : value(value) {}
-
-  void insert(const string* word) {
-    int d = edit_distance(*value, *word);
-    const auto& it = children.lower_bound(d);
-    if (it != children.end() && it->first == d)
-      it->second->insert(word);
-    else
-      children.insert(it, Edges::value_type(d, make_unique<BkTree>(word)));
+// Dictionary words with one character replaced, as from a spell checker.
+vector<string> make_typos(const vector<string>& words, int count,
+                          unsigned seed) {
+  mt19937 rng(seed);
+  vector<string> typos;
+  for (int i = 0; i < count; ++i) {
+    string word = words[rng() % words.size()];
+    word[rng() % word.size()] = 'a' + rng() % 26;
+    typos.push_back(word);
   }
+  return typos;
+}
 
-  int depth() const {
-    int d = 0;
-    for (auto&& it : children)
-      d = max(d, it.second->depth());
-    return d + 1;
+// Nodes visited and time per query, for all words within n against the k
+// nearest and the first match within n.
+void bench_nearest(const FrozenBkTree& frozen, const vector<string>& words) {
+  const int kQueries = 200;
+  vector<string> typos = make_typos(words, kQueries, 3);
+  for (int n = 1; n <= 3; ++n) {
+    for (int k : {0, 1, 5, -1}) {  // 0: all within n, -1: first match
+      long count = 0;
+      auto start_time = chrono::high_resolution_clock::now();
+      for (auto&& typo : typos) {
+        int visited = 0;
+        if (k == 0) {
+          vector<StringRef> results;
+          frozen.query(typo, n, &results, &visited);
+        } else if (k > 0) {
+          vector<pair<int, StringRef>> results;
+          frozen.nearest(typo, k, n, &results, &visited);
+        } else {
+          pair<int, StringRef> match(0, typo);
+          frozen.first_match(typo, n, &match, &visited);
+        }
+        count += visited;
+      }
+      auto end_time = chrono::high_resolution_clock::now();
+      double us = chrono::duration_cast<chrono::microseconds>(end_time -
+                                                              start_time)
+                      .count();
+      cout << "n = " << n << ", "
+           << (k == 0 ? "all" : k < 0 ? "first" : to_string(k) + " nearest")
+           << ": " << count / kQueries << " nodes, " << us / kQueries
+           << "us per query" << endl;
+    }
   }
-};
+}
+
+// Build time, and nodes visited and time per query for 200 typos, for each
+// metric on the first 100000 words. n is 2, or 4 for KeyboardWeighted, whose
+// units are half as big.
+template <class Metric>
+void bench_metric(const char* name, const vector<string>& words, int n) {
+  const int kQueries = 200;
+  vector<string> sample(words.begin(),
+                        words.begin() + min<size_t>(words.size(), 100000));
+  auto start_time = chrono::high_resolution_clock::now();
+  auto index = BasicBkTree<Metric>::build(sample, 1);
+  BasicFrozenBkTree<Metric> frozen(*index);
+  auto end_time = chrono::high_resolution_clock::now();
+  double build_ms = chrono::duration_cast<chrono::milliseconds>(end_time -
+                                                                start_time)
+                        .count();
+
+  vector<string> typos = make_typos(sample, kQueries, 4);
+  long count = 0;
+  start_time = chrono::high_resolution_clock::now();
+  for (auto&& typo : typos) {
+    int visited = 0;
+    vector<StringRef> results;
+    frozen.query(typo, n, &results, &visited);
+    count += visited;
+  }
+  end_time = chrono::high_resolution_clock::now();
+  double us = chrono::duration_cast<chrono::microseconds>(end_time -
+                                                          start_time).count();
+  cout << name << ": build " << build_ms << "ms, n = " << n << ": "
+       << count / kQueries << " nodes, " << us / kQueries << "us per query"
+       << endl;
+}
+
+void bench_metrics(const vector<string>& words) {
+  bench_metric<Levenshtein>("levenshtein", words, 2);
+  bench_metric<Damerau>("damerau", words, 2);
+  bench_metric<KeyboardWeighted>("keyboard", words, 4);
+  bench_metric<Hamming>("hamming", words, 2);
+}
+
+// Nodes visited (distances computed) and time per query for n = 1 to 4.
+template <class Index>
+void bench_index(const char* name, const Index& index, double build_ms,
+                 const vector<string>& typos) {
+  cout << name << ": build " << build_ms << "ms, " << index.bytes() / 1e6
+       << "MB" << endl;
+  for (int n = 1; n <= 4; ++n) {
+    long count = 0;
+    auto start_time = chrono::high_resolution_clock::now();
+    for (auto&& typo : typos) {
+      int visited = 0;
+      vector<StringRef> results;
+      index.query(typo, n, &results, &visited);
+      count += visited;
+    }
+    auto end_time = chrono::high_resolution_clock::now();
+    double us = chrono::duration_cast<chrono::microseconds>(end_time -
+                                                            start_time)
+                    .count();
+    cout << "  n = " << n << ": " << count / typos.size() << " nodes, "
+         << us / typos.size() << "us per query" << endl;
+  }
+}
+
+// The BK-tree against the other indexes with the same query interface, on
+// all words.
+void bench_indexes(const vector<string>& words) {
+  vector<string> typos = make_typos(words, 100, 5);
+  auto start_time = chrono::high_resolution_clock::now();
+  FrozenBkTree frozen(*BkTree::build(words, 1));
+  auto end_time = chrono::high_resolution_clock::now();
+  bench_index("bk-tree", frozen,
+              chrono::duration_cast<chrono::milliseconds>(end_time -
+                                                          start_time).count(),
+              typos);
+
+  start_time = chrono::high_resolution_clock::now();
+  VpTree<Levenshtein> vp(words);
+  end_time = chrono::high_resolution_clock::now();
+  bench_index("vp-tree", vp,
+              chrono::duration_cast<chrono::milliseconds>(end_time -
+                                                          start_time).count(),
+              typos);
+
+  start_time = chrono::high_resolution_clock::now();
+  QGramIndex qgrams(words);
+  end_time = chrono::high_resolution_clock::now();
+  bench_index("q-grams", qgrams,
+              chrono::duration_cast<chrono::milliseconds>(end_time -
+                                                          start_time).count(),
+              typos);
+}
+
+// Heap allocations and time per query on the frozen tree, with matches
+// appended to a vector, and reported through a callback. One warm-up round
+// first, for the per-thread scratch space.
+void bench_allocations(const FrozenBkTree& frozen,
+                       const vector<string>& words) {
+  const int kQueries = 200, kDistance = 2;
+  vector<string> typos = make_typos(words, kQueries, 6);
+  for (int callback = 0; callback <= 1; ++callback) {
+    long matches = 0, allocated = 0;
+    chrono::high_resolution_clock::duration time{};
+    for (int round = 0; round < 2; ++round) {
+      long before = allocations;
+      auto start_time = chrono::high_resolution_clock::now();
+      for (auto&& typo : typos) {
+        int count = 0;
+        if (callback) {
+          frozen.query(typo, kDistance, [&](StringRef) { ++matches; }, &count);
+        } else {
+          vector<StringRef> results;
+          frozen.query(typo, kDistance, &results, &count);
+          matches += results.size();
+        }
+      }
+      time = chrono::high_resolution_clock::now() - start_time;
+      allocated = allocations - before;
+    }
+    double us = chrono::duration_cast<chrono::microseconds>(time).count();
+    cout << (callback ? "callback" : "vector") << ": "
+         << double(allocated) / kQueries << " allocations, "
+         << us / kQueries << "us per query" << endl;
+  }
+}
+
+// Queries per second of query_batch() on a FrozenBkTree, for 1, 2, 4, ...
+// threads, up to twice the number of cores.
+void bench_batch(const FrozenBkTree& frozen, const vector<string>& words) {
+  const int kQueries = 400, kDistance = 1;
+  vector<string> typos = make_typos(words, kQueries, 2);
+  vector<StringRef> queries(typos.begin(), typos.end());
+
+  int max_threads = 2 * max(1u, thread::hardware_concurrency());
+  size_t expected = 0;
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    auto start_time = chrono::high_resolution_clock::now();
+    auto results = query_batch(frozen, queries, kDistance, threads);
+    auto end_time = chrono::high_resolution_clock::now();
+
+    size_t matches = 0;
+    for (auto&& result : results)
+      matches += result.size();
+    if (threads == 1)
+      expected = matches;
+    double s = chrono::duration_cast<chrono::microseconds>(end_time -
+                                                           start_time).count()
+               / 1e6;
+    cout << threads << " threads: " << kQueries / s << " queries/s"
+         << (matches == expected ? "" : " MISMATCH") << endl;
+  }
+}
+
+// BkTree::build() on 1, 2, 4, ... threads, up to twice the number of cores,
+// next to the serial build above.
+void bench_build(const vector<string>& words, int depth) {
+  int max_threads = 2 * max(1u, thread::hardware_concurrency());
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    auto start_time = chrono::high_resolution_clock::now();
+    unique_ptr<BkTree> index = BkTree::build(words, threads);
+    auto end_time = chrono::high_resolution_clock::now();
+    cout << "Parallel construction on " << threads << " threads took "
+         << chrono::duration_cast<chrono::milliseconds>(end_time - start_time)
+                .count() << "ms" << (index->depth() == depth ? "" : " MISMATCH")
+         << endl;
+  }
+}
 
 }  // namespace
 
@@ -92,9 +362,9 @@ int main(int argc, char* argv[]) {
     return EXIT_FAILURE;
 
   auto start_time = chrono::high_resolution_clock::now();
-  BkTree index(&words[0]);
+  BkTree index(words[0]);
   for (size_t i = 1; i < words.size(); ++i)
-    index.insert(&words[i]);
+    index.insert(words[i]);
   auto end_time = chrono::high_resolution_clock::now();
   cout << "Index construction took "
        << chrono::duration_cast<chrono::milliseconds>(end_time - start_time)
@@ -102,4 +372,14 @@ int main(int argc, char* argv[]) {
 
   cout << "Index depth: " << index.depth() << " (size: " << words.size()
        << ")" << endl;
+
+  bench_build(words, index.depth());
+  bench_kernels(words);
+
+  FrozenBkTree frozen(index);
+  bench_nearest(frozen, words);
+  bench_allocations(frozen, words);
+  bench_metrics(words);
+  bench_indexes(words);
+  bench_batch(frozen, words);
 }
@@ -1,5 +1,19 @@
 /*
 clang -O2 cab/gunzip.c
+
+Can also be used as a library for in-memory decompression of raw deflate,
+zlib, or gzip data:
+
+  #define GUNZIP_NO_MAIN
+  #include "gunzip.c"
+
+  struct InflateState s;
+  inflate_init(&s, kInflateZlib);
+  struct Output out;
+  output_init(&out, NULL);  // NULL: write to out.buf
+  inflate_stream(&s, data, size, &out);  // out.buf now has out.buf_size bytes
+  free(out.buf);
+  inflate_free(&s);
 */
 #define _CRT_SECURE_NO_WARNINGS
 #include <stdarg.h>
@@ -23,7 +37,7 @@ static uint16_t little_uint16t(uint8_t* d) {
 }
 
 static uint32_t little_uint32t(uint8_t* d) {
-  return d[3] << 24 | d[2] << 16 | d[1] << 8 | d[0];
+  return (uint32_t)d[3] << 24 | d[2] << 16 | d[1] << 8 | d[0];
 }
 
 // rfc1951 describes the deflate bitstream.
@@ -35,23 +49,46 @@ struct Bitstream {
   size_t source_len;
 };
 
+// Loads curword_val without reading past the end of source.
+static void bitstream_load(struct Bitstream* bs) {
+  if (bs->curword + 1 < bs->source_len)
+    bs->curword_val = little_uint16t(bs->source + bs->curword);
+  else if (bs->curword < bs->source_len)
+    bs->curword_val = bs->source[bs->curword];
+  else
+    bs->curword_val = 0;
+}
+
 static void bitstream_init(
     struct Bitstream* bs, uint8_t* source, size_t source_len) {
   bs->curbit = 0;
   bs->curword = 0;
-  bs->curword_val = little_uint16t(source);
   bs->source = source;
   bs->source_len = source_len;
+  bitstream_load(bs);
+}
+
+// Moves to a position previously read from curword and curbit.
+static void bitstream_seek(struct Bitstream* bs, size_t curword, int curbit) {
+  bs->curbit = curbit;
+  bs->curword = curword;
+  bitstream_load(bs);
+}
+
+// Returns the offset of the first byte after the current bit position.
+static size_t bitstream_byte_pos(struct Bitstream* bs) {
+  return bs->curword + (bs->curbit + 7) / 8;
 }
 
 static int bitstream_getbit(struct Bitstream* bs) {
+  if (bs->curword >= bs->source_len)
+    fatal("unexpected end of input\n");
   int bit = (bs->curword_val >> bs->curbit) & 1;
   bs->curbit += 1;
   if (bs->curbit > 15) {
     bs->curbit = 0;
     bs->curword += 2;  // in bytes
-    if (bs->curword < bs->source_len)
-      bs->curword_val = little_uint16t(bs->source + bs->curword);
+    bitstream_load(bs);
   }
   return bit;
 }
@@ -70,17 +107,22 @@ static void bitstream_parse_uncompressed_block(
   size_t start = bs->curword;
   if (bs->curbit > 0) ++start;
   if (bs->curbit > 8) ++start;
+  if (start + 4 > bs->source_len)
+    fatal("truncated uncompressed block\n");
   *size = little_uint16t(bs->source + start);
   *nsize = little_uint16t(bs->source + start + 2);
   *data = bs->source + start + 4;
   bs->curbit = 0;
   bs->curword = start + 4 + *size;
-  if (bs->curword < bs->source_len)
-    bs->curword_val = little_uint16t(bs->source + bs->curword);
+  if (bs->curword > bs->source_len)
+    fatal("truncated uncompressed block\n");
+  bitstream_load(bs);
 }
 
+// Deflate code lengths are at most 15, LZX (see uncab.c) allows 16.
+enum { kMaxCodeLength = 16 };
 struct HuffTree {
-  int count[16];
+  int count[kMaxCodeLength + 1];
   uint16_t* storage;
 };
 
@@ -94,8 +136,8 @@ static void hufftree_init(
     ht->count[nodelengths[i]]++;
   ht->count[0] = 0;
   ht->storage = storage;
-  int offs[16]; offs[0] = 0;
-  for (int i = 1; i < 16; ++i)
+  int offs[kMaxCodeLength + 1]; offs[0] = 0;
+  for (int i = 1; i <= kMaxCodeLength; ++i)
     offs[i] = offs[i - 1] + ht->count[i - 1];
   for (int i = 0; i < nodecount; ++i) {
     int len_i = nodelengths[i];
@@ -109,6 +151,8 @@ static int hufftree_readsym(struct HuffTree* ht, struct Bitstream* bs) {
   int curcount = *count++;
   int off = 0, first_at_cur = 0, first_at_next = curcount;
   while (curbits >= first_at_next) {
+    // Incomplete trees have codes that aren't assigned to any symbol.
+    if (count > ht->count + kMaxCodeLength) fatal("invalid huffman code\n");
     // Note that this uses reversed bit order compared to bitstream_getbits()
     curbits = (curbits << 1) | bitstream_getbit(bs);
     first_at_cur = first_at_next << 1;
@@ -118,73 +162,193 @@ static int hufftree_readsym(struct HuffTree* ht, struct Bitstream* bs) {
   return ht->storage[off + curbits - first_at_cur];
 }
 
+// The window is a linear buffer: win_size bytes of history, followed by
+// room for kWindowChunk (or win_size, if larger) bytes of new output, followed
+// by kWindowSlack bytes that match copies may overwrite when they copy in
+// 16-byte chunks.
+// New output is appended at win_write without any wrap checks; once
+// win_write reaches win_limit, the new output is written out and the last
+// win_size bytes are moved back to the start of the buffer.
+enum { kWindowChunk = 1 << 17, kWindowSlack = 512 };  // max match is 258
 struct Window {
   int win_write;
   int win_size;
+  int win_limit;
   uint8_t* window;  // XXX ownership?
 };
 
 static void window_init(struct Window* w, int window_size) {
-  w->win_write = 0;
   w->win_size = 1 << window_size;
-  w->window = malloc(w->win_size);
+  // Start with win_size bytes of zero history so that window_save() and
+  // window_slide() never need to special-case the start of the stream.
+  w->win_write = w->win_size;
+  // Sliding moves win_size bytes, so slide at most once per win_size output.
+  int chunk = w->win_size > kWindowChunk ? w->win_size : kWindowChunk;
+  w->win_limit = w->win_size + chunk;
+  w->window = calloc(w->win_limit + kWindowSlack, 1);
 }
 
 static void window_output_literal(struct Window* w, uint8_t c) {
-  if (w->win_write >= w->win_size)
-    w->win_write = 0;
-  w->window[w->win_write] = c;
-  w->win_write++;
+  w->window[w->win_write++] = c;
 }
 
+// Moves the last win_size bytes to the start of the buffer. Everything after
+// them must have been written out already.
+static void window_slide(struct Window* w) {
+  memmove(w->window, w->window + w->win_write - w->win_size, w->win_size);
+  w->win_write = w->win_size;
+}
+
+// Appends a stored block, which the caller has written out already.
 static void window_output_block(struct Window* w, uint8_t* d, uint16_t size) {
-  if (size > w->win_size) {
-    d += size - w->win_size;
-    size = w->win_size;
-  }
-  size_t rightspace = w->win_size - w->win_write;
-  if (rightspace >= size) {
-    memcpy(w->window + w->win_write, d, size);
-    w->win_write += size;
-  } else {
-    size_t leftspace = size - rightspace;
-    memcpy(w->window + w->win_write, d, rightspace);
-    memcpy(w->window, d + rightspace, leftspace);
-    w->win_write = leftspace;
+  if (size >= w->win_size) {
+    memcpy(w->window, d + size - w->win_size, w->win_size);
+    w->win_write = w->win_size;
+    return;
   }
+  if (w->win_write + size > w->win_limit)
+    window_slide(w);
+  memcpy(w->window + w->win_write, d, size);
+  w->win_write += size;
 }
 
 static void window_copy_match(
     struct Window* w, int match_offset, int match_length) {
-  // match_offset is relative to the end of the window.
-  bool no_overlap = w->win_write >= match_offset >= match_length &&
-                    w->win_write + match_length < w->win_size;
-  match_offset = w->win_write - match_offset;
-  if (no_overlap) {
-    // Can use faster memcpy().
-    // XXX: measure if this actually helps in C.
-    memcpy(w->window + w->win_write, w->window + match_offset, match_length);
-    w->win_write += match_length;
-    return;
+  // match_offset is relative to the end of the window. The history before
+  // win_write is always at least win_size bytes, so src is in the buffer.
+  uint8_t* dst = w->window + w->win_write;
+  const uint8_t* src = dst - match_offset;
+  w->win_write += match_length;
+  uint8_t* end = dst + match_length;
+  if (match_offset >= 16) {
+    // Each chunk only reads bytes before dst, so overlap doesn't matter.
+    // The last chunk can write up to 15 bytes past end, into the slack.
+    do {
+      memcpy(dst, src, 16);
+      dst += 16; src += 16;
+    } while (dst < end);
+  } else if (match_offset >= 8) {
+    do {
+      memcpy(dst, src, 8);
+      dst += 8; src += 8;
+    } while (dst < end);
+  } else if (match_offset == 1) {
+    // Run-length encoding of a single byte.
+    memset(dst, *src, match_length);
+  } else {
+    // Short repeating pattern. Once the first (period - match_offset) bytes
+    // are written, the output repeats with a period of at least 8 bytes, so
+    // the rest can be copied in 8-byte chunks from dst - period.
+    int period = match_offset;
+    while (period < 8)
+      period += match_offset;
+    uint8_t* head_end = dst + (period - match_offset);
+    if (head_end > end)
+      head_end = end;
+    while (dst < head_end)
+      *dst++ = *src++;
+    for (src = dst - period; dst < end; dst += 8, src += 8)
+      memcpy(dst, src, 8);
+  }
+}
+
+// Where decoded bytes go: a FILE, or a growing memory buffer if f is NULL.
+// Only the bytes in [skip, end) of the uncompressed stream are written, which
+// lets extract mode start decoding at a checkpoint before the requested range
+// and stop soon after it.
+enum OutputCheck { kCheckNone, kCheckCrc32, kCheckAdler32 };
+struct Output {
+  FILE* f;
+  uint8_t* buf;
+  size_t buf_size, buf_capacity;
+  uint64_t pos;  // Uncompressed bytes produced so far.
+  uint64_t skip;
+  uint64_t end;
+  enum OutputCheck check;  // Checksum of all produced bytes, for trailers.
+  uint32_t checksum;
+};
+
+static void output_init(struct Output* o, FILE* f) {
+  memset(o, 0, sizeof(*o));
+  o->f = f;
+  o->end = UINT64_MAX;
+}
+
+static uint32_t crc_table[256];
+
+static void make_crc_table(void) {
+  for (uint32_t n = 0; n < 256; n++) {
+    uint32_t c = n;
+    for (int k = 0; k < 8; k++)
+      c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+    crc_table[n] = c;
   }
-  if (match_offset < 0)
-    match_offset += w->win_size;
-  // Max match length is 258, win size is 32768, match will always fit.
-  for (int i = 0; i < match_length; ++i) {
-    window_output_literal(w, w->window[match_offset]);  // FIXME: chunkier?
-    match_offset += 1;
-    if (match_offset >= w->win_size)
-      match_offset -= w->win_size;
+}
+
+static uint32_t update_crc(uint32_t crc, const uint8_t* buf, size_t len) {
+  uint32_t c = ~crc;
+  for (size_t n = 0; n < len; n++)
+    c = crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
+  return ~c;
+}
+
+static uint32_t update_adler32(uint32_t adler, const uint8_t* buf, size_t len) {
+  const uint32_t BASE = 65521;  // largest prime smaller than 65536
+  uint32_t s1 = adler & 0xffff, s2 = adler >> 16;
+  while (len > 0) {
+    // 5552 is the largest n for which s2 can't overflow 32 bits before the
+    // modulo, see zlib's adler32.c.
+    size_t n = len < 5552 ? len : 5552;
+    len -= n;
+    while (n--) {
+      s1 += *buf++;
+      s2 += s1;
+    }
+    s1 %= BASE;
+    s2 %= BASE;
   }
+  return (s2 << 16) | s1;
 }
 
-static void window_write_from(struct Window* w, FILE* outfile, int win_start) {
-  if (w->win_write >= win_start)
-    fwrite(w->window + win_start, 1, w->win_write - win_start, outfile);
-  else {
-    fwrite(w->window + win_start, 1, w->win_size - win_start, outfile);
-    fwrite(w->window, 1, w->win_write, outfile);
+static void output_write(struct Output* o, uint8_t* d, size_t size) {
+  if (o->check == kCheckCrc32)
+    o->checksum = update_crc(o->checksum, d, size);
+  else if (o->check == kCheckAdler32)
+    o->checksum = update_adler32(o->checksum, d, size);
+
+  uint64_t start = o->pos, stop = o->pos + size;
+  o->pos = stop;
+  if (start < o->skip) start = o->skip;
+  if (stop > o->end) stop = o->end;
+  if (start >= stop)
+    return;
+  d += start - (o->pos - size);
+  size = stop - start;
+  if (o->f) {
+    fwrite(d, 1, size, o->f);
+    return;
   }
+  if (o->buf_size + size > o->buf_capacity) {
+    o->buf_capacity = 2 * o->buf_capacity + size;
+    o->buf = realloc(o->buf, o->buf_capacity);
+  }
+  memcpy(o->buf + o->buf_size, d, size);
+  o->buf_size += size;
+}
+
+static void window_write_from(
+    struct Window* w, struct Output* out, int win_start) {
+  output_write(out, w->window + win_start, w->win_write - win_start);
+}
+
+// Copies the last win_size bytes of output, oldest byte first, to d.
+static void window_save(struct Window* w, uint8_t* d) {
+  memcpy(d, w->window + w->win_write - w->win_size, w->win_size);
+}
+
+static void window_restore(struct Window* w, uint8_t* d) {
+  memcpy(w->window, d, w->win_size);
+  w->win_write = w->win_size;
 }
 
 static void deflate_decode_pretree(struct HuffTree* pretree,
@@ -203,17 +367,20 @@ static void deflate_decode_pretree(struct HuffTree* pretree,
       i += 1;
     } else if (code == 16) {
       int n = 3 + bitstream_getbits(bitstream, 2);
+      if (i == 0 || i + n > num_lengths) fatal("invalid code lengths\n");
       for (int j = i; j < i+n; ++j)
         lengths[j] = lengths[i - 1];
       i += n;
     } else if(code == 17) {
       int n = 3 + bitstream_getbits(bitstream, 3);
+      if (i + n > num_lengths) fatal("invalid code lengths\n");
       for (int j = i; j < i+n; ++j)
         lengths[j] = 0;
       i += n;
     } else {
       // code == 18
       int n = 11 + bitstream_getbits(bitstream, 7);
+      if (i + n > num_lengths) fatal("invalid code lengths\n");
       for (int j = i; j < i+n; ++j)
         lengths[j] = 0;
       i += n;
@@ -221,63 +388,21 @@ static void deflate_decode_pretree(struct HuffTree* pretree,
   }
 }
 
-int main(int argc, char* argv[]) {
-  if (argc <= 1)
-    fatal("need filename\n");
-  FILE* in = fopen(argv[1], "rb");
-  if (!in)
-    fatal("failed to open %s\n", argv[1]);
-
-  fseek(in, 0, SEEK_END);
-  long size = ftell(in);
-  rewind(in);
-
-  uint8_t* gz = (uint8_t*)malloc(size);
-  fread(gz, 1, size, in);
-
-  if (size < 10) fatal("file too small\n");
-
-  if (memcmp("\x1f\x8b", gz, 2)) fatal("invalid file header\n");
-  if (gz[2] != 8) fatal("unexpected compression method %d\n", gz[2]);
-  uint8_t flags = gz[3];
-  time_t mtime = little_uint32t(gz + 4);
-  uint8_t extra_flags = gz[8];
-  uint8_t os = gz[9];
-  size_t off = 10;
-
-  printf("flags %d\n", flags);
-  printf("mtime %s", ctime(&mtime));  // ctime() result contains trailing \n
-  printf("extra_flags %d\n", extra_flags);
-  printf("os %d\n", os);
-
-  if (flags & 4) {
-    uint32_t extra_size = little_uint32t(gz + off);
-    printf("extra size %d\n", extra_size);
-    off += 4 + extra_size;
-  }
-
-  if (flags & 8) {
-    printf("name %s\n", gz + off);
-    off += strlen((char*)gz + off) + 1;
-  }
-
-  if (flags & 16) {
-    printf("comment %s\n", gz + off);
-    off += strlen((char*)gz + off) + 1;
-  }
-
-  if (flags & 2) {
-    printf("header crc16 %d\n", little_uint16t(gz + off));
-    off += 2;
-  }
+// XXX explain.
+static int extra_len_bits[7*4 + 1];
+static int base_lengths[7*4 + 1];
+static int extra_dist_bits[30];
+static int base_dists[30];
 
-  // XXX explain.
-  int extra_len_bits[7*4 + 1] = {0};
+static void deflate_init_tables(void) {
+  static bool initialized = false;
+  if (initialized)
+    return;
+  initialized = true;
   for (int i = 0; i < 6*4; ++i)
     extra_len_bits[i + 4] = i/4;
   extra_len_bits[7*4] = 0;
   int base_length = 3;
-  int base_lengths[7*4 + 1];
   for (int i = 0; i < 7*4 + 1; ++i) {
     base_lengths[i] = base_length;
     base_length += 1 << extra_len_bits[i];
@@ -287,51 +412,95 @@ int main(int argc, char* argv[]) {
   // as code 284 (base position 227) + 31 in the 5 extra bits. The construction
   // in the loop above would assign 259 to code 285 instead.
   base_lengths[7*4] = 258;
-  int extra_dist_bits[30] = {0};
   for (int i = 0; i < 28; ++i)
     extra_dist_bits[i + 2] = i/2;
   int base_dist = 1;
-  int base_dists[30];
   for (int i = 0; i < 30; ++i) {
     base_dists[i] = base_dist;
     base_dist += 1 << extra_dist_bits[i];
   }
+  make_crc_table();
+}
 
-  FILE* outfile = fopen("gunzip.out", "wb");
-  struct Bitstream bitstream;
-  bitstream_init(&bitstream, gz + off, size - off - 8);
-  struct Window window;
-  window_init(&window, 15);
+// A point at the start of a deflate block from which decoding can resume
+// without looking at earlier input, like zlib's examples/zran.c.
+// Deflate blocks don't have to start on byte boundaries, so this stores
+// the bit position, and the last 32kB of output since matches can refer back
+// that far.
+enum { kCheckpointWindowSize = 1 << 15 };
+struct Checkpoint {
+  uint64_t out_pos;  // Offset in the uncompressed data.
+  size_t curword;    // Bitstream position, relative to the deflate data.
+  int curbit;
+  uint8_t* window;   // kCheckpointWindowSize bytes.
+};
+
+struct Index {
+  uint64_t span;  // Minimum uncompressed distance between checkpoints.
+  int count, capacity;
+  struct Checkpoint* points;
+};
+
+static void index_add(struct Index* index, struct Bitstream* bs,
+                      struct Window* w, uint64_t out_pos) {
+  if (index->count == index->capacity) {
+    index->capacity = index->capacity ? 2 * index->capacity : 16;
+    index->points = realloc(index->points,
+                            index->capacity * sizeof(struct Checkpoint));
+  }
+  struct Checkpoint* c = &index->points[index->count++];
+  c->out_pos = out_pos;
+  c->curword = bs->curword;
+  c->curbit = bs->curbit;
+  c->window = malloc(kCheckpointWindowSize);
+  window_save(w, c->window);
+}
+
+// Decodes deflate blocks until the last block or until out->end is reached.
+// If index is non-NULL, adds a checkpoint every index->span bytes.
+static void inflate_blocks(struct Bitstream* bitstream,
+                           struct Window* window,
+                           struct Output* out,
+                           struct Index* index) {
   bool is_last_block;
   do {
-    is_last_block = bitstream_getbit(&bitstream);
-    int block_type = bitstream_getbits(&bitstream, 2);
+    // All output of the previous block has been written at this point, so
+    // out->pos is the uncompressed offset of this block.
+    if (index && (index->count == 0 ||
+        out->pos - index->points[index->count - 1].out_pos >= index->span))
+      index_add(index, bitstream, window, out->pos);
+
+    is_last_block = bitstream_getbit(bitstream);
+    int block_type = bitstream_getbits(bitstream, 2);
     if (block_type == 3) fatal("invalid block\n");
 
     if (block_type == 0) {
       uint16_t size, nsize;
       uint8_t* data;
-      bitstream_parse_uncompressed_block(&bitstream, &size, &nsize, &data);
+      bitstream_parse_uncompressed_block(bitstream, &size, &nsize, &data);
       if (size != (uint16_t)~nsize) fatal("invalid uncompressed header\n");
-      fwrite(data, 1, size, outfile);
-      window_output_block(&window, data, size);
+      output_write(out, data, size);
+      window_output_block(window, data, size);
       continue;
     }
 
-    enum { kMaxLitLenCount = 288, kMaxDistCount = 30 };
+    // The fixed trees have 288 and 32 codes, the last two of each unused.
+    enum { kMaxLitLenCount = 288, kMaxDistCount = 32 };
     int lengths[kMaxLitLenCount + kMaxDistCount];
     int num_literals_lengths;
     int num_distances;
     if (block_type == 2) {
       // dynamic huffman code, read huffman tree description
-      num_literals_lengths = bitstream_getbits(&bitstream, 5) + 257;
-      num_distances = bitstream_getbits(&bitstream, 5) + 1;
-      int num_pretree = bitstream_getbits(&bitstream, 4) + 4;
+      num_literals_lengths = bitstream_getbits(bitstream, 5) + 257;
+      num_distances = bitstream_getbits(bitstream, 5) + 1;
+      int num_pretree = bitstream_getbits(bitstream, 4) + 4;
+      if (num_literals_lengths > 286 || num_distances > 30)
+        fatal("invalid block\n");
       int pretree_order[] = {16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15};
       enum { kLenCount = 19 };
       int pretree_lengths[kLenCount], i;
       for (i = 0; i < num_pretree; ++i)
-        pretree_lengths[pretree_order[i]] = bitstream_getbits(&bitstream, 3);
+        pretree_lengths[pretree_order[i]] = bitstream_getbits(bitstream, 3);
       for (; i < kLenCount; ++i)
         pretree_lengths[pretree_order[i]] = 0;
 
@@ -340,7 +509,7 @@ int main(int argc, char* argv[]) {
       // "The code length repeat codes can cross from HLIT + 257 to the HDIST +
       // 1 code lengths", so we have to use a single list for the huflengths
       // here.
-      deflate_decode_pretree(&pretree, &bitstream, lengths,
+      deflate_decode_pretree(&pretree, bitstream, lengths,
                              num_literals_lengths + num_distances);
     } else {
       int i = 0;
@@ -358,40 +527,350 @@ int main(int argc, char* argv[]) {
     hufftree_init(&disttree,
         lengths + num_literals_lengths, num_distances, disttree_storage);
 
-    int win_start = window.win_write;
+    int win_start = window->win_write;
     for(;;) {
-      int code = hufftree_readsym(&littree, &bitstream);
+      int code = hufftree_readsym(&littree, bitstream);
       if (code == 256) {
         break;
       } else if (code < 256) {
         // literal
-        window_output_literal(&window, (uint8_t)code);
+        window_output_literal(window, (uint8_t)code);
         //printf("lit %d\n", code);
       } else if (code > 256) {
         // match. codes 257..285 represent lengths 3..258 (hence some bits might
         // have to follow the mapped code).
         code -= 257;
+        if (code > 7*4) fatal("invalid length code\n");
         int match_len = base_lengths[code] +
-                        bitstream_getbits(&bitstream, extra_len_bits[code]);
-        int dist = hufftree_readsym(&disttree, &bitstream);
+                        bitstream_getbits(bitstream, extra_len_bits[code]);
+        int dist = hufftree_readsym(&disttree, bitstream);
+        if (dist >= 30) fatal("invalid distance code\n");
         int match_offset = base_dists[dist] +
-                           bitstream_getbits(&bitstream, extra_dist_bits[dist]);
-        window_copy_match(&window, match_offset, match_len);
+                           bitstream_getbits(bitstream, extra_dist_bits[dist]);
+        window_copy_match(window, match_offset, match_len);
         //printf("match %d %d\n", match_offset, match_len);
       }
       // We could write to disk right after each literal and match, but instead
-      // just write every 16kB. Since the max match is 258 bytes, we won't miss
-      // data in the window after a long match: long matches are still short
-      // compared to the window size.
-      if (((window.win_write - win_start) & 0x7fff) > 0x3fff) {
-        window_write_from(&window, outfile, win_start);
-        win_start = window.win_write;
+      // just write every kWindowChunk bytes, when the window is full. A match
+      // is at most 258 bytes, so it never runs past the window's slack.
+      if (window->win_write >= window->win_limit) {
+        window_write_from(window, out, win_start);
+        window_slide(window);
+        win_start = window->win_write;
+        if (out->pos >= out->end)
+          return;
       }
     }
-    window_write_from(&window, outfile, win_start);
-  } while (!is_last_block);
-  fclose(outfile);
+    window_write_from(window, out, win_start);
+  } while (!is_last_block && out->pos < out->end);
+}
+
+// rfc1952 describes the gzip header and footer.
+static size_t gzip_parse_header(uint8_t* gz, size_t size, bool verbose) {
+  if (size < 18) fatal("file too small\n");
+
+  if (memcmp("\x1f\x8b", gz, 2)) fatal("invalid file header\n");
+  if (gz[2] != 8) fatal("unexpected compression method %d\n", gz[2]);
+  uint8_t flags = gz[3];
+  time_t mtime = little_uint32t(gz + 4);
+  uint8_t extra_flags = gz[8];
+  uint8_t os = gz[9];
+  size_t off = 10;
+
+  if (verbose) {
+    printf("flags %d\n", flags);
+    printf("mtime %s", ctime(&mtime));  // ctime() result contains trailing \n
+    printf("extra_flags %d\n", extra_flags);
+    printf("os %d\n", os);
+  }
+
+  if (flags & 4) {
+    uint16_t extra_size = little_uint16t(gz + off);
+    if (verbose) printf("extra size %d\n", extra_size);
+    off += 2 + extra_size;
+  }
+
+  if (flags & 8) {
+    if (verbose) printf("name %s\n", gz + off);
+    off += strlen((char*)gz + off) + 1;
+  }
+
+  if (flags & 16) {
+    if (verbose) printf("comment %s\n", gz + off);
+    off += strlen((char*)gz + off) + 1;
+  }
+
+  if (flags & 2) {
+    if (verbose) printf("header crc16 %d\n", little_uint16t(gz + off));
+    off += 2;
+  }
+  if (off + 8 > size) fatal("file too small\n");
+  return off;
+}
+
+// rfc1950 describes the zlib header and footer.
+static size_t zlib_parse_header(uint8_t* z, size_t size) {
+  if (size < 6) fatal("file too small\n");
+  if ((z[0] & 0xf) != 8) fatal("unexpected compression method %d\n", z[0] & 0xf);
+  if ((z[0] >> 4) > 7) fatal("invalid window size %d\n", z[0] >> 4);
+  if ((z[0] << 8 | z[1]) % 31 != 0) fatal("invalid header check bits\n");
+  if (z[1] & 0x20) fatal("preset dictionaries not supported\n");
+  return 2;
+}
+
+enum InflateFormat { kInflateRaw, kInflateZlib, kInflateGzip };
+
+struct InflateState {
+  enum InflateFormat format;
+  bool verbose;  // Print gzip header fields to stdout.
+  struct Window window;
+};
+
+static inline void inflate_init(struct InflateState* s,
+                                enum InflateFormat format) {
+  deflate_init_tables();
+  s->format = format;
+  s->verbose = false;
+  window_init(&s->window, 15);
+}
+
+static inline void inflate_free(struct InflateState* s) {
+  free(s->window.window);
+}
+
+// Returns the offset of the deflate data in in.
+static size_t inflate_parse_header(
+    struct InflateState* s, uint8_t* in, size_t in_len) {
+  switch (s->format) {
+    case kInflateRaw: return 0;
+    case kInflateZlib: return zlib_parse_header(in, in_len);
+    case kInflateGzip: return gzip_parse_header(in, in_len, s->verbose);
+  }
+  return 0;
+}
+
+// Decompresses one complete stream from in to out and checks the zlib or gzip
+// trailer. Returns the number of input bytes used.
+// The window is kept between calls, so formats like MSZIP that continue one
+// deflate history across several raw streams can call this once per piece.
+static inline size_t inflate_stream(struct InflateState* s,
+                                    uint8_t* in,
+                                    size_t in_len,
+                                    struct Output* out) {
+  size_t off = inflate_parse_header(s, in, in_len), trailer_size = 0;
+  if (s->format == kInflateGzip) {
+    out->check = kCheckCrc32;
+    out->checksum = 0;
+    trailer_size = 8;
+  } else if (s->format == kInflateZlib) {
+    out->check = kCheckAdler32;
+    out->checksum = 1;
+    trailer_size = 4;
+  }
+  uint64_t start_pos = out->pos;
+
+  struct Bitstream bitstream;
+  bitstream_init(&bitstream, in + off, in_len - off);
+  inflate_blocks(&bitstream, &s->window, out, NULL);
+  off += bitstream_byte_pos(&bitstream);
+  out->check = kCheckNone;
+
+  if (off + trailer_size > in_len)
+    fatal("truncated input\n");
+  if (s->format == kInflateGzip) {
+    if (little_uint32t(in + off) != out->checksum)
+      fatal("crc32 mismatch\n");
+    if (little_uint32t(in + off + 4) != (uint32_t)(out->pos - start_pos))
+      fatal("size mismatch\n");
+  } else if (s->format == kInflateZlib) {
+    uint8_t* a = in + off;
+    if ((uint32_t)(a[0] << 24 | a[1] << 16 | a[2] << 8 | a[3]) != out->checksum)
+      fatal("adler32 mismatch\n");
+  }
+  return off + trailer_size;
+}
+
+// Decodes all of in without writing anything, adding a checkpoint to index
+// every index->span bytes. Returns the uncompressed size.
+static inline uint64_t inflate_build_index(struct InflateState* s,
+                                           uint8_t* in,
+                                           size_t in_len,
+                                           struct Index* index) {
+  size_t off = inflate_parse_header(s, in, in_len);
+  struct Bitstream bitstream;
+  bitstream_init(&bitstream, in + off, in_len - off);
+  struct Output out;
+  output_init(&out, NULL);
+  out.skip = UINT64_MAX;
+  inflate_blocks(&bitstream, &s->window, &out, index);
+  return out.pos;
+}
+
+// Decodes from checkpoint c on, until out->end. out->pos and out->skip
+// should be set up by the caller. No trailer is checked.
+static inline void inflate_from_checkpoint(struct InflateState* s,
+                                           uint8_t* in,
+                                           size_t in_len,
+                                           struct Checkpoint* c,
+                                           struct Output* out) {
+  // Checkpoints store positions relative to the start of the deflate data.
+  size_t off = inflate_parse_header(s, in, in_len);
+  struct Bitstream bitstream;
+  bitstream_init(&bitstream, in + off, in_len - off);
+  bitstream_seek(&bitstream, c->curword, c->curbit);
+  window_restore(&s->window, c->window);
+  inflate_blocks(&bitstream, &s->window, out, NULL);
+}
+
+#ifndef GUNZIP_NO_MAIN
+
+static void fput_le(uint64_t u, int n, FILE* f) {
+  for (int i = 0; i < n; i++) fputc((uint8_t)(u >> (8*i)), f);
+}
+
+static uint64_t little_uint64t(uint8_t* d) {
+  return (uint64_t)little_uint32t(d + 4) << 32 | little_uint32t(d);
+}
+
+// Index file format, all little-endian:
+//   "GZIX", uint32_t checkpoint count, then per checkpoint
+//   uint64_t out_pos, uint64_t curword, uint32_t curbit, 32kB window.
+enum { kIndexEntrySize = 8 + 8 + 4 + kCheckpointWindowSize };
+
+static void index_write(struct Index* index, const char* filename) {
+  FILE* f = fopen(filename, "wb");
+  if (!f)
+    fatal("failed to open %s\n", filename);
+  fwrite("GZIX", 1, 4, f);
+  fput_le(index->count, 4, f);
+  for (int i = 0; i < index->count; ++i) {
+    struct Checkpoint* c = &index->points[i];
+    fput_le(c->out_pos, 8, f);
+    fput_le(c->curword, 8, f);
+    fput_le(c->curbit, 4, f);
+    fwrite(c->window, 1, kCheckpointWindowSize, f);
+  }
+  fclose(f);
+}
+
+// Reads the last checkpoint at or before out_pos from an index file.
+// Returns false if the index has no usable checkpoint.
+static bool index_find(const char* filename, uint64_t out_pos,
+                       struct Checkpoint* c) {
+  FILE* f = fopen(filename, "rb");
+  if (!f)
+    fatal("failed to open %s\n", filename);
+  uint8_t header[8];
+  if (fread(header, 1, 8, f) != 8 || memcmp(header, "GZIX", 4))
+    fatal("invalid index file %s\n", filename);
+  uint32_t count = little_uint32t(header + 4);
+
+  // Checkpoints are sorted by out_pos; only read the fixed-size entry
+  // headers while searching, and the window of the one that's used.
+  bool found = false;
+  long found_window = 0;
+  uint8_t entry[20];
+  for (uint32_t i = 0; i < count; ++i) {
+    fseek(f, 8 + (long)i * kIndexEntrySize, SEEK_SET);
+    if (fread(entry, 1, sizeof(entry), f) != sizeof(entry))
+      fatal("truncated index file %s\n", filename);
+    if (little_uint64t(entry) > out_pos)
+      break;
+    c->out_pos = little_uint64t(entry);
+    c->curword = little_uint64t(entry + 8);
+    c->curbit = little_uint32t(entry + 16);
+    found = true;
+    found_window = ftell(f);
+  }
+  if (found) {
+    fseek(f, found_window, SEEK_SET);
+    c->window = malloc(kCheckpointWindowSize);
+    if (fread(c->window, 1, kCheckpointWindowSize, f) != kCheckpointWindowSize)
+      fatal("truncated index file %s\n", filename);
+  }
+  fclose(f);
+  return found;
+}
+
+int main(int argc, char* argv[]) {
+  // Modes:
+  //   gunzip file.gz                     writes gunzip.out
+  //   gunzip -i index [-s MB] file.gz    writes a checkpoint every MB
+  //   gunzip -x index offset length file.gz
+  //                                      writes that byte range to stdout
+  // -raw and -zlib read raw deflate or zlib data instead of gzip.
+  enum InflateFormat format = kInflateGzip;
+  const char* index_file = NULL;
+  bool extract = false;
+  uint64_t span = 1 << 20, extract_offset = 0, extract_length = 0;
+  for (; argc > 1 && argv[1][0] == '-'; ++argv, --argc) {
+    if (strcmp(argv[1], "-raw") == 0) {
+      format = kInflateRaw;
+    } else if (strcmp(argv[1], "-zlib") == 0) {
+      format = kInflateZlib;
+    } else if (strcmp(argv[1], "-i") == 0 && argc > 2) {
+      index_file = argv[2];
+      ++argv; --argc;
+    } else if (strcmp(argv[1], "-s") == 0 && argc > 2) {
+      span = strtoull(argv[2], NULL, 10) << 20;
+      ++argv; --argc;
+    } else if (strcmp(argv[1], "-x") == 0 && argc > 4) {
+      index_file = argv[2];
+      extract = true;
+      extract_offset = strtoull(argv[3], NULL, 10);
+      extract_length = strtoull(argv[4], NULL, 10);
+      argv += 3; argc -= 3;
+    } else {
+      fatal("unknown flag %s\n", argv[1]);
+    }
+  }
+  if (argc <= 1)
+    fatal("need filename\n");
+  FILE* in = fopen(argv[1], "rb");
+  if (!in)
+    fatal("failed to open %s\n", argv[1]);
 
+  fseek(in, 0, SEEK_END);
+  long size = ftell(in);
+  rewind(in);
+
+  uint8_t* gz = (uint8_t*)malloc(size);
+  fread(gz, 1, size, in);
+
+  struct InflateState state;
+  inflate_init(&state, format);
+  struct Output out;
+
+  if (!index_file) {
+    state.verbose = true;
+    FILE* outfile = fopen("gunzip.out", "wb");
+    output_init(&out, outfile);
+    inflate_stream(&state, gz, size, &out);
+    fclose(outfile);
+  } else if (extract) {
+    struct Checkpoint c;
+    if (!index_find(index_file, extract_offset, &c))
+      fatal("no checkpoint in %s\n", index_file);
+    output_init(&out, stdout);
+    out.pos = c.out_pos;
+    out.skip = extract_offset;
+    out.end = extract_offset + extract_length;
+    inflate_from_checkpoint(&state, gz, size, &c, &out);
+    free(c.window);
+  } else {
+    struct Index index = { span, 0, 0, NULL };
+    uint64_t total = inflate_build_index(&state, gz, size, &index);
+    index_write(&index, index_file);
+    fprintf(stderr, "%d checkpoints for %llu bytes\n", index.count,
+            (unsigned long long)total);
+    for (int i = 0; i < index.count; ++i)
+      free(index.points[i].window);
+    free(index.points);
+  }
+
+  inflate_free(&state);
   free(gz);
   fclose(in);
 }
+
+#endif  // GUNZIP_NO_MAIN
@@ -0,0 +1,234 @@
+/*
+clang -O2 cab/gunzip_bench.c -o gunzip_bench -lz
+
+Benchmarks gunzip.c's decoder against system zlib. Generates a small corpus
+of different kinds of data (and also takes files from the command line),
+compresses each with zlib, and reports decompression MB/s of uncompressed
+output for both decoders. Both outputs are checked against the original
+data.
+
+  gunzip_bench [file...]
+*/
+#define GUNZIP_NO_MAIN
+#include "gunzip.c"
+
+#include <zlib.h>
+
+static double now(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// xorshift, so that the corpus is the same on every run.
+static uint32_t rng_state = 2463534242u;
+static uint32_t rng(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+enum { kCorpusSize = 8 << 20 };
+
+// Log lines with timestamps, a few levels, and repeating messages.
+static uint8_t* gen_text_log(size_t* size) {
+  static const char* levels[] = { "INFO", "INFO", "INFO", "WARNING", "ERROR" };
+  static const char* msgs[] = {
+    "connection from %u.%u.%u.%u accepted",
+    "request /api/v1/items/%u took %u ms",
+    "cache miss for key user:%u:profile (%u entries)",
+    "retrying upload of chunk %u after %u ms",
+  };
+  char* d = malloc(kCorpusSize + 256);
+  size_t n = 0;
+  unsigned t = 1500000000;
+  while (n < kCorpusSize) {
+    t += rng() % 3;
+    n += sprintf(d + n, "%u.%06u %s ", t, rng() % 1000000,
+                 levels[rng() % 5]);
+    n += sprintf(d + n, msgs[rng() % 4], rng() % 256, rng() % 1000,
+                 rng() % 256, rng() % 256);
+    d[n++] = '\n';
+  }
+  *size = kCorpusSize;
+  return (uint8_t*)d;
+}
+
+// Arrays of binary records with slowly changing fields.
+static uint8_t* gen_binary(size_t* size) {
+  uint8_t* d = malloc(kCorpusSize);
+  struct { uint32_t id; float x, y; uint16_t flags, kind; } r = { 0 };
+  for (size_t n = 0; n + sizeof(r) <= kCorpusSize; n += sizeof(r)) {
+    r.id++;
+    r.x += (rng() % 100) / 10.0f;
+    r.y = (float)(rng() % 1000);
+    if (rng() % 16 == 0) r.flags = rng();
+    r.kind = rng() % 4;
+    memcpy(d + n, &r, sizeof(r));
+  }
+  *size = kCorpusSize / sizeof(r) * sizeof(r);
+  return d;
+}
+
+// Random bytes, like already-compressed data. zlib stores most of this in
+// stored blocks.
+static uint8_t* gen_random(size_t* size) {
+  uint8_t* d = malloc(kCorpusSize);
+  for (size_t n = 0; n < kCorpusSize; n += 4) {
+    uint32_t r = rng();
+    memcpy(d + n, &r, 4);
+  }
+  *size = kCorpusSize;
+  return d;
+}
+
+static uint8_t* gen_image(size_t* size) {
+  // An RGBA gradient with some noise, 1000 pixels wide.
+  uint8_t* d = malloc(kCorpusSize);
+  for (size_t n = 0; n < kCorpusSize; n += 4) {
+    size_t x = (n / 4) % 1000, y = n / 4000;
+    d[n] = x / 4; d[n + 1] = y; d[n + 2] = (x + y) / 8 + rng() % 4;
+    d[n + 3] = 255;
+  }
+  *size = kCorpusSize;
+  return d;
+}
+
+// Like wpng.c's output: a zlib stream with one stored block per scanline.
+static uint8_t* zlib_stored_blocks(uint8_t* d, size_t size, size_t* z_size) {
+  const size_t kScanline = 4000;
+  uint8_t* z = malloc(2 + size + 5 * (size / kScanline + 1) + 4);
+  size_t n = 0;
+  z[n++] = 0x08; z[n++] = 29;
+  for (size_t off = 0; off < size; off += kScanline) {
+    uint16_t len = size - off < kScanline ? size - off : kScanline;
+    z[n++] = off + len == size;
+    z[n++] = len; z[n++] = len >> 8; z[n++] = ~len; z[n++] = ~len >> 8;
+    memcpy(z + n, d + off, len);
+    n += len;
+  }
+  uint32_t adler = adler32(1, d, size);
+  z[n++] = adler >> 24; z[n++] = adler >> 16; z[n++] = adler >> 8;
+  z[n++] = adler;
+  *z_size = n;
+  return z;
+}
+
+static uint8_t* zlib_compress(uint8_t* d, size_t size, size_t* z_size) {
+  uLongf n = compressBound(size);
+  uint8_t* z = malloc(n);
+  if (compress2(z, &n, d, size, 6) != Z_OK)
+    fatal("compress2 failed\n");
+  *z_size = n;
+  return z;
+}
+
+static uint8_t* read_file(const char* name, size_t* size) {
+  FILE* f = fopen(name, "rb");
+  if (!f)
+    fatal("failed to open %s\n", name);
+  fseek(f, 0, SEEK_END);
+  *size = ftell(f);
+  rewind(f);
+  uint8_t* d = malloc(*size);
+  if (fread(d, 1, *size, f) != *size)
+    fatal("failed to read %s\n", name);
+  fclose(f);
+  return d;
+}
+
+// Runs each decoder until it took at least 0.5s and at least 3 times, and
+// returns the fastest time.
+enum { kMinRuns = 3 };
+static const double kMinTime = 0.5;
+
+static double bench_gunzip(uint8_t* z, size_t z_size, struct Output* out) {
+  double best = 1e30, total = 0;
+  output_init(out, NULL);
+  for (int run = 0; run < kMinRuns || total < kMinTime; ++run) {
+    double start = now();
+    out->buf_size = 0;  // Reuse the buffer from the previous run.
+    out->pos = 0;
+    struct InflateState s;
+    inflate_init(&s, kInflateZlib);
+    inflate_stream(&s, z, z_size, out);
+    inflate_free(&s);
+    double t = now() - start;
+    if (t < best) best = t;
+    total += t;
+  }
+  return best;
+}
+
+static double bench_zlib(uint8_t* z, size_t z_size, uint8_t* out,
+                         size_t size) {
+  double best = 1e30, total = 0;
+  for (int run = 0; run < kMinRuns || total < kMinTime; ++run) {
+    double start = now();
+    uLongf n = size;
+    if (uncompress(out, &n, z, z_size) != Z_OK || n != size)
+      fatal("uncompress failed\n");
+    double t = now() - start;
+    if (t < best) best = t;
+    total += t;
+  }
+  return best;
+}
+
+static void bench(const char* name, uint8_t* d, size_t size,
+                  uint8_t* z, size_t z_size) {
+  uint32_t crc = crc32(0, d, size);
+
+  struct Output out;
+  double t_gunzip = bench_gunzip(z, z_size, &out);
+  if (out.buf_size != size || crc32(0, out.buf, size) != crc)
+    fatal("%s: gunzip.c output mismatch\n", name);
+  free(out.buf);
+
+  uint8_t* zout = malloc(size);
+  double t_zlib = bench_zlib(z, z_size, zout, size);
+  if (crc32(0, zout, size) != crc)
+    fatal("%s: zlib output mismatch\n", name);
+  free(zout);
+
+  double mb = size / 1e6;
+  printf("%-20s %8.1f MB %6.1f%% %10.1f %10.1f %8.2fx\n", name, mb,
+         100.0 * z_size / size, mb / t_gunzip, mb / t_zlib, t_gunzip / t_zlib);
+}
+
+int main(int argc, char* argv[]) {
+  printf("%-20s %11s %7s %10s %10s %9s\n", "input", "size", "ratio",
+         "gunzip.c", "zlib", "slowdown");
+  printf("%-20s %11s %7s %10s %10s\n", "", "", "", "MB/s", "MB/s");
+
+  struct { const char* name; uint8_t* (*gen)(size_t*); } corpus[] = {
+    { "text log", gen_text_log },
+    { "binary records", gen_binary },
+    { "random", gen_random },
+    { "rgba image", gen_image },
+  };
+  for (size_t i = 0; i < sizeof(corpus) / sizeof(corpus[0]); ++i) {
+    size_t size, z_size;
+    uint8_t* d = corpus[i].gen(&size);
+    uint8_t* z = zlib_compress(d, size, &z_size);
+    bench(corpus[i].name, d, size, z, z_size);
+    free(z);
+    if (corpus[i].gen == gen_image) {
+      z = zlib_stored_blocks(d, size, &z_size);
+      bench("stored scanlines", d, size, z, z_size);
+      free(z);
+    }
+    free(d);
+  }
+
+  for (int i = 1; i < argc; ++i) {
+    size_t size, z_size;
+    uint8_t* d = read_file(argv[i], &size);
+    uint8_t* z = zlib_compress(d, size, &z_size);
+    const char* name = strrchr(argv[i], '/');
+    bench(name ? name + 1 : argv[i], d, size, z, z_size);
+    free(z);
+    free(d);
+  }
+}
@@ -0,0 +1,723 @@
+/*
+clang -O2 cab/uncab.c -o uncab -lpthread
+
+Extracts .cab files as written by Windows's makecab.exe, see dumpcab.py for
+the file format. Supports uncompressed, MSZIP, and LZX folders.
+
+Each CFFOLDER is an independent compression stream, so folders are decoded
+in parallel, one folder per thread. Large cabs (e.g. from the Windows SDK)
+usually have many folders.
+
+  uncab [-d outdir] [-j threads] file.cab
+*/
+#define GUNZIP_NO_MAIN
+#include "gunzip.c"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct CabFile {
+  uint32_t cbFile;  // Uncompressed size of this file in bytes.
+  uint32_t uoffFolderStart;  // Uncompressed offset of this file in folder.
+  uint16_t iFolder;
+  char* name;
+};
+
+struct CabFolder {
+  uint32_t coffCabStart;  // Offset of first CFDATA block in this folder.
+  uint16_t cCFData;       // Number of CFDATA blocks in this folder.
+  uint16_t typeCompress;
+  uint64_t compressed_size;  // Sum of cbData, for scheduling.
+  struct CabFile** files;    // Sorted by uoffFolderStart.
+  int num_files;
+};
+
+struct Cab {
+  uint8_t* data;
+  size_t size;
+  uint8_t cbCFData;  // Per-CFDATA reserved bytes.
+  int num_folders;
+  struct CabFolder* folders;
+  int num_files;
+  struct CabFile* files;
+  const char* outdir;
+};
+
+static void cab_check(struct Cab* cab, size_t off, size_t n) {
+  if (off + n > cab->size) fatal("truncated cab file\n");
+}
+
+static int cabfile_cmp(const void* a, const void* b) {
+  const struct CabFile* fa = *(struct CabFile* const*)a;
+  const struct CabFile* fb = *(struct CabFile* const*)b;
+  return fa->uoffFolderStart < fb->uoffFolderStart ? -1 :
+         fa->uoffFolderStart > fb->uoffFolderStart;
+}
+
+// Returns 0 for names that would escape outdir: absolute paths and paths with
+// a ".." component. Expects '/' as separator.
+static int is_safe_name(const char* name) {
+  if (name[0] == '/') return 0;
+  for (const char* c = name; *c; ) {
+    const char* end = strchr(c, '/');
+    if (!end) end = c + strlen(c);
+    if (end - c == 2 && c[0] == '.' && c[1] == '.') return 0;
+    c = *end ? end + 1 : end;
+  }
+  return 1;
+}
+
+// https://msdn.microsoft.com/en-us/library/bb417343.aspx#cabinet_format
+static void cab_parse(struct Cab* cab) {
+  uint8_t* d = cab->data;
+  cab_check(cab, 0, 36);
+  if (memcmp(d, "MSCF", 4)) fatal("invalid file header\n");
+  uint32_t coffFiles = little_uint32t(d + 16);
+  cab->num_folders = little_uint16t(d + 26);
+  cab->num_files = little_uint16t(d + 28);
+  uint16_t flags = little_uint16t(d + 30);
+  size_t off = 36;
+  uint8_t cbCFFolder = 0;
+  cab->cbCFData = 0;
+  if (flags & 4) {
+    cab_check(cab, off, 4);
+    uint16_t cbCFHeader = little_uint16t(d + off);
+    cbCFFolder = d[off + 2];
+    cab->cbCFData = d[off + 3];
+    off += 4 + cbCFHeader;
+  }
+  if (flags & 3) fatal("multi-cabinet sets not supported\n");
+
+  cab->folders = calloc(cab->num_folders, sizeof(struct CabFolder));
+  for (int i = 0; i < cab->num_folders; ++i) {
+    cab_check(cab, off, 8);
+    struct CabFolder* folder = &cab->folders[i];
+    folder->coffCabStart = little_uint32t(d + off);
+    folder->cCFData = little_uint16t(d + off + 4);
+    folder->typeCompress = little_uint16t(d + off + 6);
+    off += 8 + cbCFFolder;
+
+    size_t data_off = folder->coffCabStart;
+    for (int j = 0; j < folder->cCFData; ++j) {
+      cab_check(cab, data_off, 8 + cab->cbCFData);
+      uint16_t cbData = little_uint16t(d + data_off + 4);
+      data_off += 8 + cab->cbCFData + cbData;
+      cab_check(cab, data_off, 0);
+      folder->compressed_size += cbData;
+    }
+  }
+
+  off = coffFiles;
+  cab->files = calloc(cab->num_files, sizeof(struct CabFile));
+  for (int i = 0; i < cab->num_files; ++i) {
+    cab_check(cab, off, 17);
+    struct CabFile* file = &cab->files[i];
+    file->cbFile = little_uint32t(d + off);
+    file->uoffFolderStart = little_uint32t(d + off + 4);
+    file->iFolder = little_uint16t(d + off + 8);
+    // date, time, attribs aren't used.
+    off += 16;
+    uint8_t* nul = memchr(d + off, '\0', cab->size - off);
+    if (!nul) fatal("truncated cab file\n");
+    // Names use '\' as directory separator, and are UTF-8 if attribs & 0x80.
+    file->name = strdup((char*)d + off);
+    for (char* c = file->name; *c; ++c)
+      if (*c == '\\') *c = '/';
+    if (!is_safe_name(file->name))
+      fatal("%s: unsafe file name\n", file->name);
+    off = nul - d + 1;
+    if (file->iFolder >= cab->num_folders)
+      fatal("%s: unsupported iFolder %x\n", file->name, file->iFolder);
+    cab->folders[file->iFolder].num_files++;
+  }
+
+  for (int i = 0; i < cab->num_folders; ++i) {
+    struct CabFolder* folder = &cab->folders[i];
+    folder->files = malloc(folder->num_files * sizeof(struct CabFile*));
+    folder->num_files = 0;
+  }
+  for (int i = 0; i < cab->num_files; ++i) {
+    struct CabFolder* folder = &cab->folders[cab->files[i].iFolder];
+    folder->files[folder->num_files++] = &cab->files[i];
+  }
+  for (int i = 0; i < cab->num_folders; ++i) {
+    struct CabFolder* folder = &cab->folders[i];
+    qsort(folder->files, folder->num_files, sizeof(struct CabFile*),
+          cabfile_cmp);
+  }
+}
+
+// Distributes a folder's uncompressed stream to the files in it.
+// Only one file per folder is open at a time.
+struct FileSink {
+  struct Cab* cab;
+  struct CabFolder* folder;
+  int cur;      // Index into folder->files.
+  FILE* f;      // Open file for folder->files[cur], or NULL.
+  uint64_t pos; // Offset in the folder's uncompressed stream.
+};
+
+static void mkdir_parents(char* path) {
+  for (char* c = path + 1; *c; ++c) {
+    if (*c != '/') continue;
+    *c = '\0';
+    if (mkdir(path, 0777) != 0 && errno != EEXIST)
+      fatal("failed to create %s\n", path);
+    *c = '/';
+  }
+}
+
+static FILE* sink_open(struct FileSink* s, struct CabFile* file) {
+  size_t n = strlen(s->cab->outdir) + strlen(file->name) + 2;
+  char* path = malloc(n);
+  snprintf(path, n, "%s/%s", s->cab->outdir, file->name);
+  mkdir_parents(path);
+  FILE* f = fopen(path, "wb");
+  if (!f)
+    fatal("failed to open %s\n", path);
+  // Files are written in 32kB pieces; let stdio collect them into larger
+  // writes.
+  setvbuf(f, NULL, _IOFBF, 1 << 20);
+  free(path);
+  return f;
+}
+
+// Closes the current file, creating it first if it was empty.
+static void sink_next_file(struct FileSink* s) {
+  if (!s->f)
+    s->f = sink_open(s, s->folder->files[s->cur]);
+  fclose(s->f);
+  s->f = NULL;
+  s->cur++;
+}
+
+static void sink_write(struct FileSink* s, uint8_t* d, size_t size) {
+  while (size > 0 && s->cur < s->folder->num_files) {
+    struct CabFile* file = s->folder->files[s->cur];
+    uint64_t start = file->uoffFolderStart, end = start + file->cbFile;
+    if (s->pos >= end) {
+      sink_next_file(s);
+      continue;
+    }
+    size_t n;
+    if (s->pos < start) {
+      n = start - s->pos < size ? start - s->pos : size;  // Skip gap.
+    } else {
+      if (!s->f)
+        s->f = sink_open(s, file);
+      n = end - s->pos < size ? end - s->pos : size;
+      fwrite(d, 1, n, s->f);
+    }
+    d += n;
+    size -= n;
+    s->pos += n;
+  }
+}
+
+static void sink_finish(struct FileSink* s) {
+  while (s->cur < s->folder->num_files) {
+    struct CabFile* file = s->folder->files[s->cur];
+    if (s->pos < (uint64_t)file->uoffFolderStart + file->cbFile)
+      fatal("%s: folder data too short\n", file->name);
+    sink_next_file(s);
+  }
+}
+
+struct CabData {
+  uint8_t* payload;
+  uint16_t cbData;    // Number of compressed bytes in this block.
+  uint16_t cbUncomp;  // Size after decompressing.
+};
+
+// Reads the CFDATA block at *off and moves *off to the next one.
+static struct CabData cab_data(struct Cab* cab, size_t* off) {
+  struct CabData data;
+  // 4 bytes checksum, which isn't verified.
+  data.cbData = little_uint16t(cab->data + *off + 4);
+  data.cbUncomp = little_uint16t(cab->data + *off + 6);
+  data.payload = cab->data + *off + 8 + cab->cbCFData;
+  *off += 8 + cab->cbCFData + data.cbData;
+  return data;
+}
+
+static void extract_stored(struct Cab* cab, struct CabFolder* folder,
+                           struct FileSink* sink) {
+  size_t off = folder->coffCabStart;
+  for (int i = 0; i < folder->cCFData; ++i) {
+    struct CabData data = cab_data(cab, &off);
+    sink_write(sink, data.payload, data.cbData);
+  }
+}
+
+// Each MSZIP CFDATA block is "CK" followed by a complete raw deflate stream,
+// but the deflate window carries over from one block to the next.
+static void extract_mszip(struct Cab* cab, struct CabFolder* folder,
+                          struct FileSink* sink) {
+  struct InflateState state;
+  inflate_init(&state, kInflateRaw);
+  struct Output out;
+  output_init(&out, NULL);
+  size_t off = folder->coffCabStart;
+  for (int i = 0; i < folder->cCFData; ++i) {
+    struct CabData data = cab_data(cab, &off);
+    if (data.cbData < 2 || memcmp(data.payload, "CK", 2))
+      fatal("invalid MSZIP block\n");
+    out.buf_size = 0;
+    inflate_stream(&state, data.payload + 2, data.cbData - 2, &out);
+    if (out.buf_size != data.cbUncomp)
+      fatal("MSZIP block size mismatch\n");
+    sink_write(sink, out.buf, out.buf_size);
+  }
+  free(out.buf);
+  inflate_free(&state);
+}
+
+// LZX documentation:
+// https://msdn.microsoft.com/en-us/library/bb417343.aspx#lzxdatacompressionformat
+// https://msdn.microsoft.com/en-us/library/cc483133.aspx is newer and has
+// most mistakes fixed.
+// https://github.com/kyz/libmspack/blob/master/libmspack/mspack/lzxd.c
+// has an explicit list of mistakes in the official docs.
+//
+// LZX reads 16-bit little-endian words like deflate, but takes bits from the
+// top of each word instead of from the bottom. Huffman codes are canonical
+// like in deflate, so HuffTree is shared with gunzip.c.
+enum {
+  kLzxNumChars = 256,
+  kLzxMaxPositionSlots = 50,
+  kLzxMainTreeMax = kLzxNumChars + kLzxMaxPositionSlots * 8,
+  kLzxNumSecondaryLengths = 249,
+  kLzxMinMatch = 2,
+  kLzxFrameSize = 32768,
+};
+
+static int lzx_getbit(struct Bitstream* bs) {
+  if (bs->curword >= bs->source_len)
+    fatal("unexpected end of input\n");
+  int bit = (bs->curword_val >> (15 - bs->curbit)) & 1;
+  bs->curbit += 1;
+  if (bs->curbit > 15) {
+    bs->curbit = 0;
+    bs->curword += 2;  // in bytes
+    bitstream_load(bs);
+  }
+  return bit;
+}
+
+static uint32_t lzx_getbits(struct Bitstream* bs, int n) {
+  // lzx orders bits left-to-right.
+  uint32_t bits = 0;
+  for (int i = 0; i < n; ++i)
+    bits = (bits << 1) | lzx_getbit(bs);
+  return bits;
+}
+
+// Like hufftree_readsym(), but with lzx bit order.
+static int lzx_readsym(struct HuffTree* ht, struct Bitstream* bs) {
+  int curbits = lzx_getbit(bs);
+  int* count = ht->count + 1;
+  int curcount = *count++;
+  int off = 0, first_at_cur = 0, first_at_next = curcount;
+  while (curbits >= first_at_next) {
+    if (count > ht->count + kMaxCodeLength)
+      fatal("invalid huffman code\n");
+    curbits = (curbits << 1) | lzx_getbit(bs);
+    first_at_cur = first_at_next << 1;
+    off += curcount;
+    first_at_next = first_at_cur + (curcount = *count++);
+  }
+  return ht->storage[off + curbits - first_at_cur];
+}
+
+// Reads a pretree description and bits encoded using it and interprets
+// those bits to update the node lengths [start, end) of a main tree.
+static void lzx_decode_pretree(struct Bitstream* bs, int* lengths,
+                               int start, int end) {
+  enum { kPretreeCount = 20 };
+  int pretree_lengths[kPretreeCount];
+  for (int i = 0; i < kPretreeCount; ++i)
+    pretree_lengths[i] = lzx_getbits(bs, 4);
+  struct HuffTree pretree; uint16_t pretree_storage[kPretreeCount];
+  hufftree_init(&pretree, pretree_lengths, kPretreeCount, pretree_storage);
+
+  int i = start;
+  while (i < end) {
+    int code = lzx_readsym(&pretree, bs);
+    // code 0-16: Len[x] = (prev_len[x] - code + 17) mod 17
+    // 17: for next (4 + getbits(4)) elements, Len[X] = 0
+    // 18: for next (20 + getbits(5)) elements, Len[X] = 0
+    // 19: for next (4 + getbits(1)) elements, Len[X] += readcode()
+    int n = 1, len;
+    if (code <= 16) {
+      len = (lengths[i] + 17 - code) % 17;
+    } else if (code == 17) {
+      n = 4 + lzx_getbits(bs, 4);
+      len = 0;
+    } else if (code == 18) {
+      n = 20 + lzx_getbits(bs, 5);
+      len = 0;
+    } else {
+      n = 4 + lzx_getbit(bs);
+      code = lzx_readsym(&pretree, bs);
+      if (code > 16) fatal("invalid pretree code\n");
+      len = (lengths[i] + 17 - code) % 17;
+    }
+    if (i + n > end) fatal("invalid pretree run\n");
+    for (int j = 0; j < n; ++j)
+      lengths[i++] = len;
+  }
+}
+
+struct Lzx {
+  struct Bitstream bs;
+  struct Window window;
+  int num_position_slots;
+  int extra_bits[kLzxMaxPositionSlots];
+  uint32_t position_base[kLzxMaxPositionSlots];
+
+  int block_type;  // 1: verbatim, 2: aligned, 3: uncompressed
+  int block_length, block_remaining;
+  uint32_t r0, r1, r2;  // Repeated offsets.
+
+  // Lengths are delta-coded against the previous block's lengths.
+  int main_lengths[kLzxMainTreeMax];
+  int length_lengths[kLzxNumSecondaryLengths];
+  int aligned_lengths[8];
+  struct HuffTree maintree, lengthtree, alignedtree;
+  uint16_t main_storage[kLzxMainTreeMax];
+  uint16_t length_storage[kLzxNumSecondaryLengths];
+  uint16_t aligned_storage[8];
+
+  // x86 call instruction (e8) translation.
+  bool intel_started;
+  int32_t intel_filesize;
+  int32_t intel_curpos;
+  int frame;
+};
+
+static void lzx_init(struct Lzx* z, int window_bits, uint8_t* in, size_t n) {
+  if (window_bits < 15 || window_bits > 21)
+    fatal("invalid LZX window size %d\n", window_bits);
+  memset(z, 0, sizeof(*z));
+  bitstream_init(&z->bs, in, n);
+  window_init(&z->window, window_bits);
+  static const int kSlots[] = { 30, 32, 34, 36, 38, 42, 50 };
+  z->num_position_slots = kSlots[window_bits - 15];
+
+  // Farther offsets need more bits: slot 4 and 5 have 1 extra bit, 6 and 7
+  // have 2, and so on, up to at most 17.
+  for (int i = 0; i < kLzxMaxPositionSlots; ++i)
+    z->extra_bits[i] = i < 4 ? 0 : (i - 2) / 2 < 17 ? (i - 2) / 2 : 17;
+  uint32_t base = 0;
+  for (int i = 0; i < kLzxMaxPositionSlots; ++i) {
+    z->position_base[i] = base;
+    base += 1 << z->extra_bits[i];
+  }
+  z->r0 = z->r1 = z->r2 = 1;
+
+  // The stream starts with a flag for the e8 transform. makecab.exe seems to
+  // always set this if the input size is at least 6 bytes, even for text.
+  if (lzx_getbit(&z->bs)) {
+    uint32_t hi = lzx_getbits(&z->bs, 16);
+    z->intel_filesize = (int32_t)(hi << 16 | lzx_getbits(&z->bs, 16));
+  }
+}
+
+static void lzx_read_block_header(struct Lzx* z) {
+  struct Bitstream* bs = &z->bs;
+  // An odd-sized uncompressed block is followed by a padding byte.
+  if (z->block_type == 3 && (z->block_length & 1)) {
+    bs->curword++;
+    bitstream_load(bs);
+  }
+  z->block_type = lzx_getbits(bs, 3);
+  uint32_t hi = lzx_getbits(bs, 16);
+  z->block_remaining = z->block_length = hi << 8 | lzx_getbits(bs, 8);
+
+  if (z->block_type == 2) {
+    for (int i = 0; i < 8; ++i)
+      z->aligned_lengths[i] = lzx_getbits(bs, 3);
+    hufftree_init(&z->alignedtree, z->aligned_lengths, 8, z->aligned_storage);
+  }
+  if (z->block_type == 1 || z->block_type == 2) {
+    // A pretree is a huffman tree for the 20 tree codes, which are then used
+    // to encode the "main" huffmann tree. There are 3 trees, each preceded by
+    // its pretree: The 256 literals of the main tree, the position slots of
+    // the main tree, and the lengths tree.
+    int main_count = kLzxNumChars + z->num_position_slots * 8;
+    lzx_decode_pretree(bs, z->main_lengths, 0, kLzxNumChars);
+    lzx_decode_pretree(bs, z->main_lengths, kLzxNumChars, main_count);
+    hufftree_init(&z->maintree, z->main_lengths, main_count, z->main_storage);
+    if (z->main_lengths[0xe8] != 0)
+      z->intel_started = true;
+    lzx_decode_pretree(bs, z->length_lengths, 0, kLzxNumSecondaryLengths);
+    hufftree_init(&z->lengthtree, z->length_lengths, kLzxNumSecondaryLengths,
+                  z->length_storage);
+  } else if (z->block_type == 3) {
+    z->intel_started = true;
+    // 1-16 bits of padding to the next 16-bit boundary: the rest of the
+    // current word, or all of it if nothing has been read from it yet.
+    // Then 12 bytes r0, r1, r2, then block_length raw bytes.
+    bs->curbit = 0;
+    bs->curword += 2;
+    if (bs->curword + 12 > bs->source_len)
+      fatal("unexpected end of input\n");
+    z->r0 = little_uint32t(bs->source + bs->curword);
+    z->r1 = little_uint32t(bs->source + bs->curword + 4);
+    z->r2 = little_uint32t(bs->source + bs->curword + 8);
+    bs->curword += 12;
+    bitstream_load(bs);
+  } else {
+    fatal("undefined LZX block type %d\n", z->block_type);
+  }
+}
+
+// Decodes n bytes of a verbatim or aligned block into the window.
+// Returns how many bytes the last match ran over n.
+static int lzx_decode_run(struct Lzx* z, int n) {
+  struct Bitstream* bs = &z->bs;
+  struct Window* w = &z->window;
+  while (n > 0) {
+    int code = lzx_readsym(&z->maintree, bs);
+    if (code < kLzxNumChars) {
+      window_output_literal(w, (uint8_t)code);
+      n -= 1;
+      continue;
+    }
+    code -= kLzxNumChars;
+    int match_length = code & 7;
+    if (match_length == 7)
+      match_length += lzx_readsym(&z->lengthtree, bs);
+    match_length += kLzxMinMatch;
+
+    int slot = code >> 3;
+    uint32_t match_offset;
+    // Check for repeated offsets in positions 0, 1, 2
+    if (slot == 0) {
+      match_offset = z->r0;
+    } else if (slot == 1) {
+      match_offset = z->r1;
+      z->r1 = z->r0; z->r0 = match_offset;
+    } else if (slot == 2) {
+      match_offset = z->r2;
+      z->r2 = z->r0; z->r0 = match_offset;
+    } else {
+      int extra = z->extra_bits[slot];
+      match_offset = z->position_base[slot] - 2;
+      if (z->block_type == 2 && extra >= 3) {
+        // The low 3 bits are coded with the aligned offset tree.
+        match_offset += lzx_getbits(bs, extra - 3) << 3;
+        match_offset += lzx_readsym(&z->alignedtree, bs);
+      } else {
+        match_offset += lzx_getbits(bs, extra);
+      }
+      z->r2 = z->r1; z->r1 = z->r0; z->r0 = match_offset;
+    }
+    if (match_offset > (uint32_t)w->win_size)
+      fatal("LZX match offset too large\n");
+    window_copy_match(w, match_offset, match_length);
+    n -= match_length;
+  }
+  return -n;
+}
+
+// Copies n bytes of an uncompressed block into the window.
+static void lzx_copy_run(struct Lzx* z, int n) {
+  struct Bitstream* bs = &z->bs;
+  if (bs->curword + n > bs->source_len)
+    fatal("unexpected end of input\n");
+  memcpy(z->window.window + z->window.win_write, bs->source + bs->curword, n);
+  z->window.win_write += n;
+  bs->curword += n;
+  bitstream_load(bs);
+}
+
+// Decodes the next frame of up to 32768 bytes to the end of the window.
+// The caller makes sure there's room for it.
+static void lzx_decode_frame(struct Lzx* z, int frame_size) {
+  int todo = frame_size;
+  while (todo > 0) {
+    if (z->block_remaining == 0)
+      lzx_read_block_header(z);
+    int run = z->block_remaining < todo ? z->block_remaining : todo;
+    todo -= run;
+    z->block_remaining -= run;
+    if (z->block_type == 3) {
+      lzx_copy_run(z, run);
+    } else if (lzx_decode_run(z, run) != 0) {
+      // Matches can't cross frame or block boundaries.
+      fatal("LZX match ran over frame\n");
+    }
+  }
+
+  // Each frame ends on a 16-bit boundary of the input.
+  if (z->bs.curbit != 0) {
+    z->bs.curbit = 0;
+    z->bs.curword += 2;
+    bitstream_load(&z->bs);
+  }
+}
+
+// Undoes the e8 transform on one frame of output.
+static void lzx_undo_x86_jump_transform(struct Lzx* z, uint8_t* d, int n) {
+  int32_t curpos = z->intel_curpos;
+  z->intel_curpos += n;
+  if (!z->intel_started || !z->intel_filesize || z->frame >= 32768 || n <= 10)
+    return;
+  for (uint8_t* end = d + n - 10; d < end; ) {
+    if (*d++ != 0xe8) {
+      curpos++;
+      continue;
+    }
+    int32_t abs_off = (int32_t)little_uint32t(d);
+    if (abs_off >= -curpos && abs_off < z->intel_filesize) {
+      int32_t rel_off = abs_off >= 0 ? abs_off - curpos
+                                     : abs_off + z->intel_filesize;
+      d[0] = rel_off; d[1] = rel_off >> 8; d[2] = rel_off >> 16;
+      d[3] = rel_off >> 24;
+    }
+    d += 4;
+    curpos += 5;
+  }
+}
+
+static void extract_lzx(struct Cab* cab, struct CabFolder* folder,
+                        struct FileSink* sink) {
+  if (folder->cCFData == 0)
+    return;
+  // LZX blocks (and uncompressed blocks in particular) can span CFDATA
+  // blocks, so decode from all payloads glued together. Each CFDATA block
+  // holds exactly one 32kB frame, padded to 16 bits.
+  uint8_t* in = malloc(folder->compressed_size);
+  uint16_t* frame_sizes = malloc(folder->cCFData * sizeof(uint16_t));
+  size_t in_size = 0, off = folder->coffCabStart;
+  for (int i = 0; i < folder->cCFData; ++i) {
+    struct CabData data = cab_data(cab, &off);
+    memcpy(in + in_size, data.payload, data.cbData);
+    in_size += data.cbData;
+    frame_sizes[i] = data.cbUncomp;
+  }
+
+  struct Lzx* z = malloc(sizeof(struct Lzx));
+  lzx_init(z, (folder->typeCompress >> 8) & 0x1f, in, in_size);
+  uint8_t* frame = malloc(kLzxFrameSize);
+  for (int i = 0; i < folder->cCFData; ++i) {
+    if (frame_sizes[i] > kLzxFrameSize)
+      fatal("invalid LZX frame size\n");
+    // Everything before win_write has been written out already.
+    if (z->window.win_write + kLzxFrameSize > z->window.win_limit)
+      window_slide(&z->window);
+    int start = z->window.win_write;
+    lzx_decode_frame(z, frame_sizes[i]);
+    // The e8 transform is undone on the output only; the window must keep
+    // the data as it was compressed.
+    memcpy(frame, z->window.window + start, frame_sizes[i]);
+    lzx_undo_x86_jump_transform(z, frame, frame_sizes[i]);
+    z->frame++;
+    sink_write(sink, frame, frame_sizes[i]);
+  }
+  free(frame);
+  free(z->window.window);
+  free(z);
+  free(frame_sizes);
+  free(in);
+}
+
+static void extract_folder(struct Cab* cab, struct CabFolder* folder) {
+  struct FileSink sink = { cab, folder, 0, NULL, 0 };
+  switch (folder->typeCompress & 0xf) {
+    case 0: extract_stored(cab, folder, &sink); break;
+    case 1: extract_mszip(cab, folder, &sink); break;
+    case 3: extract_lzx(cab, folder, &sink); break;
+    default: fatal("unsupported compression %d\n", folder->typeCompress & 0xf);
+  }
+  sink_finish(&sink);
+}
+
+// Worker threads take folders from a shared queue, biggest first so that
+// one big folder doesn't end up being started last.
+struct FolderQueue {
+  struct Cab* cab;
+  int* order;
+  int next;
+  pthread_mutex_t lock;
+};
+
+static void* folder_worker(void* arg) {
+  struct FolderQueue* q = arg;
+  for (;;) {
+    pthread_mutex_lock(&q->lock);
+    int i = q->next < q->cab->num_folders ? q->order[q->next++] : -1;
+    pthread_mutex_unlock(&q->lock);
+    if (i < 0)
+      return NULL;
+    extract_folder(q->cab, &q->cab->folders[i]);
+  }
+}
+
+static struct Cab* sort_cab;  // qsort() has no context parameter.
+static int folder_size_cmp(const void* a, const void* b) {
+  uint64_t sa = sort_cab->folders[*(const int*)a].compressed_size;
+  uint64_t sb = sort_cab->folders[*(const int*)b].compressed_size;
+  return sa > sb ? -1 : sa < sb;
+}
+
+int main(int argc, char* argv[]) {
+  struct Cab cab = { 0 };
+  cab.outdir = ".";
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  for (; argc > 1 && argv[1][0] == '-'; ++argv, --argc) {
+    if (strcmp(argv[1], "-d") == 0 && argc > 2) {
+      cab.outdir = argv[2];
+      ++argv; --argc;
+    } else if (strcmp(argv[1], "-j") == 0 && argc > 2) {
+      num_threads = atoi(argv[2]);
+      ++argv; --argc;
+    } else {
+      fatal("unknown flag %s\n", argv[1]);
+    }
+  }
+  if (argc <= 1)
+    fatal("usage: uncab [-d outdir] [-j threads] file.cab\n");
+  FILE* in = fopen(argv[1], "rb");
+  if (!in)
+    fatal("failed to open %s\n", argv[1]);
+  fseek(in, 0, SEEK_END);
+  cab.size = ftell(in);
+  rewind(in);
+  cab.data = malloc(cab.size);
+  if (fread(cab.data, 1, cab.size, in) != cab.size)
+    fatal("failed to read %s\n", argv[1]);
+  fclose(in);
+
+  cab_parse(&cab);
+  deflate_init_tables();  // Not thread-safe, so do it before starting threads.
+
+  struct FolderQueue q = { .cab = &cab,
+                           .order = malloc(cab.num_folders * sizeof(int)) };
+  pthread_mutex_init(&q.lock, NULL);
+  for (int i = 0; i < cab.num_folders; ++i)
+    q.order[i] = i;
+  sort_cab = &cab;
+  qsort(q.order, cab.num_folders, sizeof(int), folder_size_cmp);
+
+  if (num_threads < 1) num_threads = 1;
+  if (num_threads > cab.num_folders) num_threads = cab.num_folders;
+  pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+  for (long i = 0; i < num_threads; ++i)
+    pthread_create(&threads[i], NULL, folder_worker, &q);
+  for (long i = 0; i < num_threads; ++i)
+    pthread_join(threads[i], NULL);
+
+  free(threads);
+  free(q.order);
+  for (int i = 0; i < cab.num_folders; ++i)
+    free(cab.folders[i].files);
+  for (int i = 0; i < cab.num_files; ++i)
+    free(cab.files[i].name);
+  free(cab.folders);
+  free(cab.files);
+  free(cab.data);
+}
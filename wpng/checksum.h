@@ -0,0 +1,211 @@
+/* crc32 (png chunks, gzip) and adler32 (zlib streams).
+
+   crc32_update() and adler32_update() work like zlib's crc32() and
+   adler32(): start with crc32_update(0, ...) / adler32_update(1, ...) and
+   pass the previous result to continue.
+
+   crc32 uses slice-by-8 tables (8 bytes per step instead of 1), and on x86
+   cpus with carry-less multiply it folds 64 bytes per step with PCLMULQDQ,
+   as described in Intel's "Fast CRC Computation for Generic Polynomials
+   Using PCLMULQDQ Instruction". adler32 only reduces modulo 65521 every
+   5552 bytes, and sums 16 bytes per step with SSE2.
+   checksum_bench.c measures all variants.
+*/
+#ifndef WPNG_CHECKSUM_H
+#define WPNG_CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CHECKSUM_PCLMUL 1
+#include <wmmintrin.h>
+#endif
+
+static uint32_t crc32_table[8][256];
+
+// crc32_table[k][n] is the crc of byte n followed by k zero bytes.
+static inline void crc32_init(void) {
+  if (crc32_table[0][128])
+    return;
+  for (uint32_t n = 0; n < 256; n++) {
+    uint32_t c = n;
+    for (int k = 0; k < 8; k++) c = (-(c & 1) & 0xedb88320u) ^ (c >> 1);
+    crc32_table[0][n] = c;
+  }
+  for (uint32_t n = 0; n < 256; n++)
+    for (int k = 1; k < 8; k++)
+      crc32_table[k][n] = crc32_table[0][crc32_table[k - 1][n] & 0xff] ^
+                          (crc32_table[k - 1][n] >> 8);
+}
+
+// These work on the raw crc register, without the pre and post inversion.
+static inline uint32_t crc32_bytewise(uint32_t c, const uint8_t* p, size_t n) {
+  while (n--) c = crc32_table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+  return c;
+}
+
+static inline uint32_t crc32_slice8(uint32_t c, const uint8_t* p, size_t n) {
+  for (; n >= 8; n -= 8, p += 8) {
+    uint32_t lo = c ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+    uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+    c = crc32_table[7][lo & 0xff] ^ crc32_table[6][(lo >> 8) & 0xff] ^
+        crc32_table[5][(lo >> 16) & 0xff] ^ crc32_table[4][lo >> 24] ^
+        crc32_table[3][hi & 0xff] ^ crc32_table[2][(hi >> 8) & 0xff] ^
+        crc32_table[1][(hi >> 16) & 0xff] ^ crc32_table[0][hi >> 24];
+  }
+  return crc32_bytewise(c, p, n);
+}
+
+#ifdef CHECKSUM_PCLMUL
+// n must be a multiple of 16 and at least 64. The constants are x^k mod P
+// for the fold distances, bit-reflected, from the Intel paper.
+__attribute__((target("pclmul,sse2")))
+static inline uint32_t crc32_pclmul(uint32_t c, const uint8_t* p, size_t n) {
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+  const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+  const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+  const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+  const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+  // Fold four 128-bit lanes, 64 bytes per step.
+  __m128i x1 = _mm_loadu_si128((const __m128i*)(p + 0));
+  __m128i x2 = _mm_loadu_si128((const __m128i*)(p + 16));
+  __m128i x3 = _mm_loadu_si128((const __m128i*)(p + 32));
+  __m128i x4 = _mm_loadu_si128((const __m128i*)(p + 48));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(c));
+  for (p += 64, n -= 64; n >= 64; p += 64, n -= 64) {
+#define FOLD(x, k, y) _mm_xor_si128(y, \
+    _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), \
+                  _mm_clmulepi64_si128(x, k, 0x11)))
+    x1 = FOLD(x1, k1k2, _mm_loadu_si128((const __m128i*)(p + 0)));
+    x2 = FOLD(x2, k1k2, _mm_loadu_si128((const __m128i*)(p + 16)));
+    x3 = FOLD(x3, k1k2, _mm_loadu_si128((const __m128i*)(p + 32)));
+    x4 = FOLD(x4, k1k2, _mm_loadu_si128((const __m128i*)(p + 48)));
+  }
+
+  // Fold the four lanes into one, then 16 bytes per step.
+  x1 = FOLD(x1, k3k4, x2);
+  x1 = FOLD(x1, k3k4, x3);
+  x1 = FOLD(x1, k3k4, x4);
+  for (; n >= 16; p += 16, n -= 16)
+    x1 = FOLD(x1, k3k4, _mm_loadu_si128((const __m128i*)p));
+#undef FOLD
+
+  // 128 to 64 bits.
+  __m128i x = _mm_xor_si128(_mm_srli_si128(x1, 8),
+                            _mm_clmulepi64_si128(x1, k3k4, 0x10));
+  x = _mm_xor_si128(_mm_srli_si128(x, 4),
+                    _mm_clmulepi64_si128(_mm_and_si128(x, mask32), k5k0, 0x00));
+
+  // Barrett reduction to 32 bits.
+  __m128i t = _mm_clmulepi64_si128(_mm_and_si128(x, mask32), poly, 0x10);
+  t = _mm_clmulepi64_si128(_mm_and_si128(t, mask32), poly, 0x00);
+  return _mm_cvtsi128_si32(_mm_srli_si128(_mm_xor_si128(x, t), 4));
+}
+
+static inline int crc32_has_pclmul(void) {
+  static int has = -1;
+  if (has < 0) has = __builtin_cpu_supports("pclmul");
+  return has;
+}
+#endif
+
+static inline uint32_t crc32_update(uint32_t crc, const uint8_t* p, size_t n) {
+  crc32_init();
+  uint32_t c = ~crc;
+#ifdef CHECKSUM_PCLMUL
+  if (n >= 64 && crc32_has_pclmul()) {
+    size_t k = n & ~(size_t)15;
+    c = crc32_pclmul(c, p, k);
+    p += k;
+    n -= k;
+  }
+#endif
+  return ~crc32_slice8(c, p, n);
+}
+
+enum {
+  kAdlerBase = 65521,  // largest prime smaller than 65536
+  // Largest n so that 255*n*(n+1)/2 + (n+1)*(kAdlerBase-1) fits in 32 bits:
+  // the sums only need to be reduced every kAdlerMax bytes.
+  kAdlerMax = 5552,
+};
+
+static inline uint32_t adler32_scalar(uint32_t adler, const uint8_t* p,
+                                      size_t n) {
+  uint32_t s1 = adler & 0xffff, s2 = adler >> 16;
+  while (n > 0) {
+    size_t k = n < kAdlerMax ? n : kAdlerMax;
+    n -= k;
+    while (k--) { s1 += *p++; s2 += s1; }
+    s1 %= kAdlerBase;
+    s2 %= kAdlerBase;
+  }
+  return s2 << 16 | s1;
+}
+
+#ifdef __SSE2__
+// For a 16 byte block b[0..15] that starts with s1 == s, s2 grows by
+// 16*s + 16*b[0] + 15*b[1] + ... + 1*b[15], and s1 by the sum of the b[i].
+static inline uint32_t adler32_sse2(uint32_t adler, const uint8_t* p,
+                                    size_t n) {
+  uint64_t s1 = adler & 0xffff, s2 = adler >> 16;
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i tap_lo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+  const __m128i tap_hi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+  while (n >= 16) {
+    size_t blocks = (n < kAdlerMax ? n : kAdlerMax) / 16;
+    n -= blocks * 16;
+    // v_s1: byte sums. v_ps: sum of v_s1 before each block.
+    __m128i v_s1 = zero, v_ps = zero, v_s2 = zero;
+    s2 += 16 * blocks * s1;
+    for (size_t i = 0; i < blocks; ++i, p += 16) {
+      __m128i b = _mm_loadu_si128((const __m128i*)p);
+      v_ps = _mm_add_epi32(v_ps, v_s1);
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(b, zero));
+      __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(b, zero), tap_lo);
+      __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(b, zero), tap_hi);
+      v_s2 = _mm_add_epi32(v_s2, _mm_add_epi32(lo, hi));
+    }
+    uint32_t a[4], ps[4], b2[4];
+    _mm_storeu_si128((__m128i*)a, v_s1);
+    _mm_storeu_si128((__m128i*)ps, v_ps);
+    _mm_storeu_si128((__m128i*)b2, v_s2);
+    s1 += a[0] + a[2];  // _mm_sad_epu8 sums into the low half of each 64 bits
+    s2 += 16 * ((uint64_t)ps[0] + ps[2]) + b2[0] + b2[1] + b2[2] + b2[3];
+    s1 %= kAdlerBase;
+    s2 %= kAdlerBase;
+  }
+  return adler32_scalar((uint32_t)(s2 << 16 | s1), p, n);
+}
+#endif
+
+static inline uint32_t adler32_update(uint32_t adler, const uint8_t* p,
+                                      size_t n) {
+#ifdef __SSE2__
+  return adler32_sse2(adler, p, n);
+#else
+  return adler32_scalar(adler, p, n);
+#endif
+}
+
+// adler32 of a followed by b, given adler32 of a, of b, and the size of b.
+// If b was summed on its own, starting from s1 = 1 and s2 = 0, then summing
+// it after a adds s1a - 1 to each of its len_b running s1 values.
+static inline uint32_t wpng_adler32_combine(uint32_t adler_a,
+                                            uint32_t adler_b,
+                                            uint64_t len_b) {
+  uint64_t s1a = adler_a & 0xffff, s2a = adler_a >> 16;
+  uint64_t s1b = adler_b & 0xffff, s2b = adler_b >> 16;
+  uint64_t s1 = (s1a + s1b + kAdlerBase - 1) % kAdlerBase;
+  uint64_t s2 = (s2a + s2b + (len_b % kAdlerBase) * (s1a + kAdlerBase - 1)) %
+                kAdlerBase;
+  return (uint32_t)(s2 << 16 | s1);
+}
+
+#endif  // WPNG_CHECKSUM_H
@@ -0,0 +1,638 @@
+/* Small single-header deflate (rfc1951) encoder, with optional zlib (rfc1950)
+   or gzip (rfc1952) framing. Streaming: feed data with deflate_write() and
+   take the compressed bytes from d->out / d->out_len after each call.
+
+     struct Deflate* d = malloc(sizeof(*d));
+     deflate_init(d, 6, kDeflateZlib);  // level 0 (stored) to 9 (smallest)
+     deflate_write(d, data, size, kDeflateFinish);
+     fwrite(d->out, 1, d->out_len, f); d->out_len = 0;
+     deflate_free(d);
+     free(d);
+
+   LZ77 uses hash chains, with greedy matching for levels 1-3 and lazy
+   matching (delay committing a match until checking if a longer match exists
+   at the next position) for 4-9, like gzip. See also cab/notes.txt.
+   Each block is written with fixed or dynamic huffman codes, or stored,
+   whichever is smallest.
+*/
+#ifndef WPNG_DEFLATE_H
+#define WPNG_DEFLATE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "checksum.h"
+
+enum DeflateFormat { kDeflateRaw, kDeflateZlib, kDeflateGzip };
+enum DeflateFlush {
+  kDeflateNoFlush,
+  kDeflateSyncFlush,  // Ends the current block and pads to a byte boundary.
+  kDeflateFinish,     // Writes the final block and the zlib/gzip trailer.
+};
+
+enum {
+  kDeflateWindow = 1 << 15,
+  kDeflateMinMatch = 3,
+  kDeflateMaxMatch = 258,
+  // Matches are only searched when at least this much input is buffered, so
+  // that a match is never cut short by the end of the buffered input.
+  kDeflateMinLookahead = kDeflateMaxMatch + kDeflateMinMatch + 1,
+  kDeflateHashBits = 15,
+  kDeflateMaxSymbols = 1 << 14,  // Symbols per block.
+  kDeflateNumLitLen = 286,
+  kDeflateNumDist = 30,
+};
+
+// ~400kB, allocate it on the heap.
+struct Deflate {
+  uint8_t* out;  // Complete output bytes; the caller resets out_len.
+  size_t out_len, out_cap;
+
+  int level;
+  enum DeflateFormat format;
+  uint32_t adler;  // zlib
+  uint32_t crc, size;  // gzip: crc32 and length mod 2^32 of the input
+  int max_chain, lazy, nice;
+
+  // Input is copied to win. Everything before pos has been turned into
+  // symbols, and block_start is where the input of the current block starts.
+  // When win is full, its second half moves to the first half.
+  uint8_t win[2 * kDeflateWindow];
+  int pos, end, block_start;
+  int32_t head[1 << kDeflateHashBits];  // -1: empty
+  int32_t prev[kDeflateWindow];         // Hash chain, indexed by pos % window.
+
+  // Lazy matching state: a match at pos - 1 that hasn't been emitted yet.
+  int prev_len, prev_dist;
+  int have_prev;  // Is win[pos - 1] still pending?
+
+  // Symbols of the current block. dist == 0 means lit_len is a literal.
+  uint16_t sym_lit_len[kDeflateMaxSymbols];
+  uint16_t sym_dist[kDeflateMaxSymbols];
+  int num_syms;
+
+  uint64_t bitbuf;
+  int bitcount;
+};
+
+static inline void deflate_grow(struct Deflate* d, size_t n) {
+  if (d->out_len + n <= d->out_cap)
+    return;
+  d->out_cap = 2 * d->out_cap + n;
+  d->out = (uint8_t*)realloc(d->out, d->out_cap);
+}
+
+// deflate packs bits starting at the least significant bit.
+static inline void deflate_put_bits(struct Deflate* d, uint32_t bits, int n) {
+  d->bitbuf |= (uint64_t)bits << d->bitcount;
+  d->bitcount += n;
+  if (d->bitcount >= 32) {
+    deflate_grow(d, 4);
+    uint8_t* o = d->out + d->out_len;
+    o[0] = d->bitbuf; o[1] = d->bitbuf >> 8; o[2] = d->bitbuf >> 16;
+    o[3] = d->bitbuf >> 24;
+    d->out_len += 4;
+    d->bitbuf >>= 32;
+    d->bitcount -= 32;
+  }
+}
+
+// Pads to a byte boundary and moves all pending bits to out.
+static inline void deflate_align(struct Deflate* d) {
+  deflate_grow(d, 8);
+  while (d->bitcount > 0) {
+    d->out[d->out_len++] = d->bitbuf;
+    d->bitbuf >>= 8;
+    d->bitcount = d->bitcount > 8 ? d->bitcount - 8 : 0;
+  }
+  d->bitbuf = 0;
+}
+
+static inline void deflate_put_bytes(struct Deflate* d, const uint8_t* p,
+                                     size_t n) {
+  deflate_grow(d, n);
+  memcpy(d->out + d->out_len, p, n);
+  d->out_len += n;
+}
+
+static inline int deflate_highest_bit(uint32_t x) {
+  int n = 0;
+  while (x >>= 1) n++;
+  return n;
+}
+
+// Lengths 3..258 map to codes 257..285, each followed by some extra bits.
+static inline int deflate_len_code(int len, int* extra_bits, int* extra) {
+  int x = len - 3;
+  if (x < 8) { *extra_bits = 0; *extra = 0; return 257 + x; }
+  if (x == 255) { *extra_bits = 0; *extra = 0; return 285; }
+  int bits = deflate_highest_bit(x) - 2;
+  *extra_bits = bits;
+  *extra = x & ((1 << bits) - 1);
+  return 257 + 4 * (bits + 1) + ((x >> bits) & 3);
+}
+
+// Distances 1..32768 map to codes 0..29, each followed by some extra bits.
+static inline int deflate_dist_code(int dist, int* extra_bits, int* extra) {
+  int x = dist - 1;
+  if (x < 4) { *extra_bits = 0; *extra = 0; return x; }
+  int bits = deflate_highest_bit(x) - 1;
+  *extra_bits = bits;
+  *extra = x & ((1 << bits) - 1);
+  return 2 * (bits + 1) + ((x >> bits) & 1);
+}
+
+// Computes huffman code lengths of at most max_len bits for freq.
+// Every symbol with nonzero frequency gets a code, and at least two symbols
+// get codes, since a code with a single 0-length symbol isn't valid.
+static inline void deflate_huffman_lengths(const uint32_t* freq, int n,
+                                           int max_len, uint8_t* lengths) {
+  int syms[kDeflateNumLitLen], num = 0;
+  memset(lengths, 0, n);
+  for (int i = 0; i < n; ++i)
+    if (freq[i]) syms[num++] = i;
+  for (int i = 0; num < 2; ++i)
+    if (!freq[i]) syms[num++] = i;
+
+  // Sort by frequency (insertion sort; n is at most 286 and mostly sorted
+  // by value already, which is good enough here).
+  uint32_t w[2 * kDeflateNumLitLen];
+  for (int i = 1; i < num; ++i) {
+    int s = syms[i], j = i;
+    for (; j > 0 && freq[syms[j - 1]] > freq[s]; --j)
+      syms[j] = syms[j - 1];
+    syms[j] = s;
+  }
+
+  // Classic two-queue huffman construction: leaves are already sorted, and
+  // internal nodes are created in order of increasing weight.
+  // Nodes 0..num-1 are leaves, num.. are internal nodes.
+  int parent[2 * kDeflateNumLitLen];
+  for (int i = 0; i < num; ++i) w[i] = freq[syms[i]];
+  int leaf = 0, node = num, next = num;
+  for (int k = 0; k < num - 1; ++k) {
+    int pick[2];
+    for (int j = 0; j < 2; ++j) {
+      if (leaf < num && (node >= next || w[leaf] <= w[node]))
+        pick[j] = leaf++;
+      else
+        pick[j] = node++;
+    }
+    w[next] = w[pick[0]] + w[pick[1]];
+    parent[pick[0]] = parent[pick[1]] = next++;
+  }
+  // Depth of each node, from the root (next - 1) downwards.
+  int depth[2 * kDeflateNumLitLen];
+  depth[next - 1] = 0;
+  for (int i = next - 2; i >= 0; --i)
+    depth[i] = depth[parent[i]] + 1;
+
+  // Limit code lengths: clamp, then lengthen codes until the kraft sum
+  // fits again (like miniz does).
+  int count[33] = { 0 };
+  for (int i = 0; i < num; ++i)
+    count[depth[i] < max_len ? depth[i] : max_len]++;
+  uint32_t kraft = 0;
+  for (int i = max_len; i > 0; --i)
+    kraft += (uint32_t)count[i] << (max_len - i);
+  while (kraft != (1u << max_len)) {
+    count[max_len]--;
+    for (int i = max_len - 1; i > 0; --i) {
+      if (count[i]) {
+        count[i]--;
+        count[i + 1] += 2;
+        break;
+      }
+    }
+    kraft--;
+  }
+  // Least frequent symbols get the longest codes.
+  for (int len = max_len, i = 0; len > 0; --len)
+    for (int c = count[len]; c > 0; --c)
+      lengths[syms[i++]] = len;
+}
+
+// Canonical huffman codes, bit-reversed since deflate sends codes starting
+// at their most significant bit.
+static inline void deflate_huffman_codes(const uint8_t* lengths, int n,
+                                         uint16_t* codes) {
+  int count[16] = { 0 }, next[16];
+  for (int i = 0; i < n; ++i) count[lengths[i]]++;
+  count[0] = 0;
+  for (int i = 1, code = 0; i < 16; ++i) {
+    code = (code + count[i - 1]) << 1;
+    next[i] = code;
+  }
+  for (int i = 0; i < n; ++i) {
+    int len = lengths[i];
+    if (!len) continue;
+    int code = next[len]++, rev = 0;
+    for (int j = 0; j < len; ++j)
+      rev |= ((code >> j) & 1) << (len - 1 - j);
+    codes[i] = rev;
+  }
+}
+
+// Run-length encodes code lengths with code length codes 16, 17, 18.
+// Each entry of out is symbol | extra bits << 8.
+static inline int deflate_rle_lengths(const uint8_t* lengths, int n,
+                                      uint16_t* out) {
+  int num = 0;
+  for (int i = 0; i < n; ) {
+    int len = lengths[i], run = 1;
+    while (i + run < n && lengths[i + run] == len) run++;
+    if (len == 0 && run >= 3) {
+      run = run > 138 ? 138 : run;
+      out[num++] = run >= 11 ? 18 | (run - 11) << 8 : 17 | (run - 3) << 8;
+    } else if (len != 0 && run >= 4) {
+      out[num++] = len;
+      run = run - 1 > 6 ? 6 : run - 1;
+      out[num++] = 16 | (run - 3) << 8;
+      run += 1;
+    } else {
+      run = 1;
+      out[num++] = len;
+    }
+    i += run;
+  }
+  return num;
+}
+
+static inline void deflate_write_symbols(struct Deflate* d,
+                                         const uint16_t* lit_codes,
+                                         const uint8_t* lit_lengths,
+                                         const uint16_t* dist_codes,
+                                         const uint8_t* dist_lengths) {
+  for (int i = 0; i < d->num_syms; ++i) {
+    int dist = d->sym_dist[i], extra_bits, extra;
+    if (!dist) {
+      int c = d->sym_lit_len[i];
+      deflate_put_bits(d, lit_codes[c], lit_lengths[c]);
+      continue;
+    }
+    int c = deflate_len_code(d->sym_lit_len[i], &extra_bits, &extra);
+    deflate_put_bits(d, lit_codes[c], lit_lengths[c]);
+    deflate_put_bits(d, extra, extra_bits);
+    c = deflate_dist_code(dist, &extra_bits, &extra);
+    deflate_put_bits(d, dist_codes[c], dist_lengths[c]);
+    deflate_put_bits(d, extra, extra_bits);
+  }
+  deflate_put_bits(d, lit_codes[256], lit_lengths[256]);
+}
+
+// Writes the symbols collected so far as one block.
+static inline void deflate_flush_block(struct Deflate* d, int is_final) {
+  uint32_t lit_freq[kDeflateNumLitLen] = { 0 };
+  uint32_t dist_freq[kDeflateNumDist] = { 0 };
+  uint64_t extra_bits_total = 0;
+  for (int i = 0; i < d->num_syms; ++i) {
+    int eb, e;
+    if (!d->sym_dist[i]) {
+      lit_freq[d->sym_lit_len[i]]++;
+      continue;
+    }
+    lit_freq[deflate_len_code(d->sym_lit_len[i], &eb, &e)]++;
+    extra_bits_total += eb;
+    dist_freq[deflate_dist_code(d->sym_dist[i], &eb, &e)]++;
+    extra_bits_total += eb;
+  }
+  lit_freq[256] = 1;  // end of block
+
+  // Dynamic codes.
+  uint8_t lit_len[kDeflateNumLitLen], dist_len[kDeflateNumDist];
+  deflate_huffman_lengths(lit_freq, kDeflateNumLitLen, 15, lit_len);
+  deflate_huffman_lengths(dist_freq, kDeflateNumDist, 15, dist_len);
+  int hlit = kDeflateNumLitLen, hdist = kDeflateNumDist;
+  while (hlit > 257 && !lit_len[hlit - 1]) hlit--;
+  while (hdist > 1 && !dist_len[hdist - 1]) hdist--;
+  // "The code length repeat codes can cross from HLIT + 257 to the HDIST + 1
+  // code lengths", so run-length encode both together.
+  uint8_t all_len[kDeflateNumLitLen + kDeflateNumDist];
+  memcpy(all_len, lit_len, hlit);
+  memcpy(all_len + hlit, dist_len, hdist);
+  uint16_t rle[kDeflateNumLitLen + kDeflateNumDist];
+  int num_rle = deflate_rle_lengths(all_len, hlit + hdist, rle);
+  uint32_t cl_freq[19] = { 0 };
+  for (int i = 0; i < num_rle; ++i) cl_freq[rle[i] & 0xff]++;
+  uint8_t cl_len[19];
+  deflate_huffman_lengths(cl_freq, 19, 7, cl_len);
+  static const uint8_t kClOrder[19] =
+      { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+  int hclen = 19;
+  while (hclen > 4 && !cl_len[kClOrder[hclen - 1]]) hclen--;
+
+  uint64_t dyn_bits = 3 + 5 + 5 + 4 + 3 * hclen + extra_bits_total;
+  for (int i = 0; i < num_rle; ++i) {
+    int s = rle[i] & 0xff;
+    dyn_bits += cl_len[s] + (s == 16 ? 2 : s == 17 ? 3 : s == 18 ? 7 : 0);
+  }
+  for (int i = 0; i < kDeflateNumLitLen; ++i)
+    dyn_bits += lit_freq[i] * lit_len[i];
+  for (int i = 0; i < kDeflateNumDist; ++i)
+    dyn_bits += dist_freq[i] * dist_len[i];
+
+  // Fixed codes: literals 0-143 use 8 bits, 144-255 9, 256-279 7, 280-287 8,
+  // and all distances 5.
+  uint8_t fixed_lit[288], fixed_dist[kDeflateNumDist];
+  for (int i = 0; i < 288; ++i)
+    fixed_lit[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+  memset(fixed_dist, 5, sizeof(fixed_dist));
+  uint64_t fixed_bits = 3 + extra_bits_total;
+  for (int i = 0; i < kDeflateNumLitLen; ++i)
+    fixed_bits += lit_freq[i] * fixed_lit[i];
+  for (int i = 0; i < kDeflateNumDist; ++i) fixed_bits += dist_freq[i] * 5;
+
+  // Stored: the input is still in the window (see deflate_write()).
+  // A pending lazy literal belongs to the next block.
+  int block_end = d->pos - d->have_prev;
+  size_t stored_size = block_end - d->block_start;
+  uint64_t stored_bits = (stored_size + 5 * (stored_size / 65535 + 1)) * 8 + 7;
+
+  if (d->level == 0 || (stored_bits <= fixed_bits && stored_bits <= dyn_bits)) {
+    const uint8_t* p = d->win + d->block_start;
+    do {
+      uint16_t n = stored_size > 65535 ? 65535 : stored_size;
+      stored_size -= n;
+      deflate_put_bits(d, is_final && !stored_size, 1);
+      deflate_put_bits(d, 0, 2);
+      deflate_align(d);
+      uint8_t h[4] = { (uint8_t)n, (uint8_t)(n >> 8), (uint8_t)~n,
+                       (uint8_t)(~n >> 8) };
+      deflate_put_bytes(d, h, 4);
+      deflate_put_bytes(d, p, n);
+      p += n;
+    } while (stored_size > 0);
+  } else if (fixed_bits <= dyn_bits) {
+    uint16_t lit_codes[288], dist_codes[kDeflateNumDist];
+    deflate_huffman_codes(fixed_lit, 288, lit_codes);
+    deflate_huffman_codes(fixed_dist, kDeflateNumDist, dist_codes);
+    deflate_put_bits(d, is_final, 1);
+    deflate_put_bits(d, 1, 2);
+    deflate_write_symbols(d, lit_codes, fixed_lit, dist_codes, fixed_dist);
+  } else {
+    deflate_put_bits(d, is_final, 1);
+    deflate_put_bits(d, 2, 2);
+    deflate_put_bits(d, hlit - 257, 5);
+    deflate_put_bits(d, hdist - 1, 5);
+    deflate_put_bits(d, hclen - 4, 4);
+    for (int i = 0; i < hclen; ++i)
+      deflate_put_bits(d, cl_len[kClOrder[i]], 3);
+    uint16_t cl_codes[19];
+    deflate_huffman_codes(cl_len, 19, cl_codes);
+    for (int i = 0; i < num_rle; ++i) {
+      int s = rle[i] & 0xff;
+      deflate_put_bits(d, cl_codes[s], cl_len[s]);
+      if (s >= 16)
+        deflate_put_bits(d, rle[i] >> 8, s == 16 ? 2 : s == 17 ? 3 : 7);
+    }
+    uint16_t lit_codes[kDeflateNumLitLen], dist_codes[kDeflateNumDist];
+    deflate_huffman_codes(lit_len, kDeflateNumLitLen, lit_codes);
+    deflate_huffman_codes(dist_len, kDeflateNumDist, dist_codes);
+    deflate_write_symbols(d, lit_codes, lit_len, dist_codes, dist_len);
+  }
+  d->num_syms = 0;
+  d->block_start = block_end;
+}
+
+static inline void deflate_literal(struct Deflate* d, int c) {
+  d->sym_lit_len[d->num_syms] = c;
+  d->sym_dist[d->num_syms++] = 0;
+}
+
+static inline void deflate_match(struct Deflate* d, int len, int dist) {
+  d->sym_lit_len[d->num_syms] = len;
+  d->sym_dist[d->num_syms++] = dist;
+}
+
+static inline uint32_t deflate_hash(const uint8_t* p) {
+  uint32_t v = p[0] | p[1] << 8 | p[2] << 16;
+  return (v * 2654435761u) >> (32 - kDeflateHashBits);
+}
+
+static inline void deflate_insert(struct Deflate* d, int p) {
+  if (p + kDeflateMinMatch > d->end)
+    return;
+  uint32_t h = deflate_hash(d->win + p);
+  d->prev[p & (kDeflateWindow - 1)] = d->head[h];
+  d->head[h] = p;
+}
+
+// Returns the length of the longest match for pos in the hash chain that
+// starts at cand if it's longer than prev_len, else 0. Sets *dist.
+static inline int deflate_longest_match(struct Deflate* d, int cand,
+                                        int prev_len, int* dist) {
+  const uint8_t* s = d->win + d->pos;
+  int max_len = d->end - d->pos;
+  if (max_len > kDeflateMaxMatch) max_len = kDeflateMaxMatch;
+  if (prev_len >= max_len)
+    return 0;
+  int best = prev_len, found = 0, chain = d->max_chain;
+  // With a good match already, don't look as hard for a better one.
+  if (prev_len >= d->lazy) chain >>= 2;
+  int limit = d->pos - kDeflateWindow;
+  while (cand >= 0 && cand > limit && chain-- > 0) {
+    const uint8_t* m = d->win + cand;
+    // Check the byte that would make this match longer than best first.
+    if (m[best] == s[best] && m[0] == s[0] && m[1] == s[1]) {
+      int len = 2;
+      while (len < max_len && m[len] == s[len]) len++;
+      if (len > best) {
+        best = len;
+        found = 1;
+        *dist = d->pos - cand;
+        if (len >= d->nice || len == max_len) break;
+      }
+    }
+    cand = d->prev[cand & (kDeflateWindow - 1)];
+  }
+  return found ? best : 0;
+}
+
+// Moves the second half of the window to the first half.
+static inline void deflate_slide(struct Deflate* d) {
+  memmove(d->win, d->win + kDeflateWindow, kDeflateWindow);
+  d->pos -= kDeflateWindow;
+  d->end -= kDeflateWindow;
+  d->block_start -= kDeflateWindow;
+  for (int i = 0; i < (1 << kDeflateHashBits); ++i)
+    d->head[i] = d->head[i] >= kDeflateWindow ? d->head[i] - kDeflateWindow
+                                              : -1;
+  for (int i = 0; i < kDeflateWindow; ++i)
+    d->prev[i] = d->prev[i] >= kDeflateWindow ? d->prev[i] - kDeflateWindow
+                                              : -1;
+}
+
+// Turns buffered input into symbols. Unless flushing, stops when less than
+// kDeflateMinLookahead bytes are left, since those might be the start of
+// a longer match.
+static inline void deflate_compress(struct Deflate* d, int flush) {
+  int stop = flush ? d->end : d->end - kDeflateMinLookahead;
+  while (d->pos < stop) {
+    if (d->num_syms >= kDeflateMaxSymbols - 2)
+      deflate_flush_block(d, 0);
+    if (d->level == 0) {
+      d->pos = stop;  // Stored blocks are written straight from win.
+      break;
+    }
+    int h = -1;
+    if (d->pos + kDeflateMinMatch <= d->end)
+      h = d->head[deflate_hash(d->win + d->pos)];
+    deflate_insert(d, d->pos);
+    int dist = 0, len = 0;
+    if (h >= 0 && (d->lazy == 0 || d->prev_len < d->lazy))
+      len = deflate_longest_match(d, h, d->have_prev ? d->prev_len : 2, &dist);
+    if (len < kDeflateMinMatch || (len == kDeflateMinMatch && dist > 4096))
+      len = 0;  // Far short matches cost more than literals.
+
+    if (d->lazy == 0) {
+      // Greedy.
+      if (len) {
+        deflate_match(d, len, dist);
+        // Fast levels only index the start of long matches.
+        int insert = len <= 16 ? len : 1;
+        for (int i = 1; i < insert; ++i) deflate_insert(d, d->pos + i);
+        d->pos += len;
+      } else {
+        deflate_literal(d, d->win[d->pos]);
+        d->pos++;
+      }
+      continue;
+    }
+
+    // Lazy: if the match at pos - 1 is at least as long, use it.
+    if (d->have_prev && d->prev_len >= kDeflateMinMatch && len <= d->prev_len) {
+      deflate_match(d, d->prev_len, d->prev_dist);
+      // pos - 1 and pos are already in the hash chains.
+      int match_end = d->pos - 1 + d->prev_len;
+      for (int p = d->pos + 1; p < match_end; ++p) deflate_insert(d, p);
+      d->pos = match_end;
+      d->have_prev = 0;
+      d->prev_len = 0;
+      continue;
+    }
+    if (d->have_prev)
+      deflate_literal(d, d->win[d->pos - 1]);
+    d->have_prev = 1;
+    d->prev_len = len;
+    d->prev_dist = dist;
+    d->pos++;
+  }
+  if (flush && d->have_prev) {
+    deflate_literal(d, d->win[d->pos - 1]);
+    d->have_prev = 0;
+    d->prev_len = 0;
+  }
+}
+
+static inline void deflate_init(struct Deflate* d, int level,
+                                enum DeflateFormat format) {
+  // Like zlib's configuration_table: lazy threshold, nice length, max chain.
+  static const int kConfig[10][3] = {
+    { 0, 0, 0 }, { 0, 8, 4 }, { 0, 16, 8 }, { 0, 32, 32 },
+    { 4, 16, 16 }, { 16, 32, 32 }, { 16, 128, 128 }, { 32, 128, 256 },
+    { 128, 258, 1024 }, { 258, 258, 4096 },
+  };
+  d->out = NULL;
+  d->out_len = d->out_cap = 0;
+  d->level = level < 0 ? 0 : level > 9 ? 9 : level;
+  d->format = format;
+  d->adler = 1;
+  d->crc = d->size = 0;
+  d->lazy = kConfig[d->level][0];
+  d->nice = kConfig[d->level][1];
+  d->max_chain = kConfig[d->level][2];
+  d->pos = d->end = d->block_start = 0;
+  d->num_syms = 0;
+  d->have_prev = d->prev_len = d->prev_dist = 0;
+  d->bitbuf = 0;
+  d->bitcount = 0;
+  memset(d->head, 0xff, sizeof(d->head));
+  memset(d->prev, 0xff, sizeof(d->prev));
+  if (format == kDeflateZlib) {
+    // 8: deflate with 32kB window; 0x01 makes the header a multiple of 31.
+    const uint8_t h[2] = { 0x78, 0x01 };
+    deflate_put_bytes(d, h, 2);
+  } else if (format == kDeflateGzip) {
+    // Magic, 8: deflate, no flags, no mtime, extra flags 2: slowest / 4:
+    // fastest compression, unknown os.
+    const uint8_t h[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0,
+                            d->level == 9 ? 2 : d->level == 1 ? 4 : 0, 0xff };
+    deflate_put_bytes(d, h, 10);
+  }
+}
+
+// Makes the last 32kB of p available for matches, without writing it. Call
+// right after deflate_init(). Used to compress parts of a stream
+// independently (see wpng_parallel() in wpng.c); the decoder gets the same
+// history from the previous part.
+static inline void deflate_set_dictionary(struct Deflate* d, const uint8_t* p,
+                                          size_t n) {
+  if (n > kDeflateWindow) {
+    p += n - kDeflateWindow;
+    n = kDeflateWindow;
+  }
+  memcpy(d->win, p, n);
+  d->end = n;
+  for (int i = 0; i < d->end; ++i) deflate_insert(d, i);
+  d->pos = d->block_start = n;
+}
+
+static inline void deflate_free(struct Deflate* d) {
+  free(d->out);
+  d->out = NULL;
+}
+
+static inline void deflate_write(struct Deflate* d, const uint8_t* data,
+                                 size_t n, enum DeflateFlush flush) {
+  if (d->format == kDeflateZlib) {
+    d->adler = adler32_update(d->adler, data, n);
+  } else if (d->format == kDeflateGzip) {
+    d->crc = crc32_update(d->crc, data, n);
+    d->size += n;
+  }
+  while (n > 0) {
+    if (d->end == 2 * kDeflateWindow) {
+      // Stored blocks need the block's input, so flush before it's lost.
+      if (d->block_start < kDeflateWindow)
+        deflate_flush_block(d, 0);
+      deflate_slide(d);
+    }
+    size_t k = 2 * kDeflateWindow - d->end;
+    if (k > n) k = n;
+    memcpy(d->win + d->end, data, k);
+    d->end += k;
+    data += k;
+    n -= k;
+    deflate_compress(d, 0);
+  }
+  if (flush == kDeflateNoFlush)
+    return;
+  deflate_compress(d, 1);
+  if (flush == kDeflateSyncFlush) {
+    if (d->num_syms || d->pos > d->block_start)
+      deflate_flush_block(d, 0);
+    // An empty stored block, so that the output ends on a byte boundary.
+    deflate_put_bits(d, 0, 3);
+    deflate_align(d);
+    const uint8_t empty[4] = { 0, 0, 0xff, 0xff };
+    deflate_put_bytes(d, empty, 4);
+  } else {
+    deflate_flush_block(d, 1);
+    deflate_align(d);
+    if (d->format == kDeflateZlib) {
+      uint32_t a = d->adler;
+      const uint8_t b[4] = { (uint8_t)(a >> 24), (uint8_t)(a >> 16),
+                             (uint8_t)(a >> 8), (uint8_t)a };
+      deflate_put_bytes(d, b, 4);
+    } else if (d->format == kDeflateGzip) {
+      const uint8_t b[8] = {
+        (uint8_t)d->crc, (uint8_t)(d->crc >> 8), (uint8_t)(d->crc >> 16),
+        (uint8_t)(d->crc >> 24), (uint8_t)d->size, (uint8_t)(d->size >> 8),
+        (uint8_t)(d->size >> 16), (uint8_t)(d->size >> 24) };
+      deflate_put_bytes(d, b, 8);
+    }
+  }
+}
+
+#endif  // WPNG_DEFLATE_H
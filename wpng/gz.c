@@ -1,63 +1,82 @@
 /*
 
-Test program to write uncompressed gzip file.
+Small gzip writer, on top of deflate.h. Build like:
 
   clang -o gz gz.c -Wall
-  ./gz | gunzip
+  ./gz 6 < file | gunzip
+
+Use it like:
+
+  struct Gz g;
+  gz_begin(&g, 6, f);  // level 0 (stored) to 9 (smallest)
+  gz_write(&g, buf, n);  // as often as needed, with any n
+  gz_flush(&g);  // optional: make everything so far decompressible
+  gz_end(&g);  // doesn't close f
 
 */
 
-#include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+
+#include "deflate.h"
 
 // http://www.ietf.org/rfc/rfc1952.txt
-uint32_t crc_table[256];
-void make_crc_table(void) {
-  for (int n = 0; n < 256; n++) {
-    uint32_t c = (uint32_t) n;
-    for (int k = 0; k < 8; k++)
-      if (c & 1)
-        c = 0xedb88320u ^ (c >> 1);
-      else
-        c = c >> 1;
-    crc_table[n] = c;
-  }
+// deflate.h writes the gzip header and trailer (crc32 and size), see
+// kDeflateGzip.
+
+enum {
+  // Compressed output is collected in memory and written in pieces this big,
+  // so that many small gz_write() calls (log lines, say) turn into few large
+  // fwrite() calls.
+  kGzBufferSize = 1 << 20,
+};
+
+struct Gz {
+  FILE* f;
+  struct Deflate* z;
+};
+
+static void gz_drain(struct Gz* g) {
+  if (g->z->out_len)
+    fwrite(g->z->out, 1, g->z->out_len, g->f);
+  g->z->out_len = 0;
 }
-uint32_t update_crc(uint32_t crc, const unsigned char *buf, int len) {
-  uint32_t c = crc ^ 0xffffffffu;
-  for (int n = 0; n < len; n++)
-    c = crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
-  return c ^ 0xffffffffu;
+
+void gz_begin(struct Gz* g, int level, FILE* f) {
+  g->f = f;
+  g->z = malloc(sizeof(*g->z));
+  deflate_init(g->z, level, kDeflateGzip);
 }
-uint32_t crc(const unsigned char *buf, int len) {
-  return update_crc(0, buf, len);
+
+void gz_write(struct Gz* g, const void* buf, size_t n) {
+  deflate_write(g->z, buf, n, kDeflateNoFlush);
+  if (g->z->out_len >= kGzBufferSize)
+    gz_drain(g);
 }
 
-void fput_n_le(uint32_t u, FILE* f, int n) {
-  for (int i = 0; i < n; i++) fputc(u >> (8*i), f);
+// Writes out all data passed to gz_write() so far, so that a reader (e.g.
+// zcat on a log file that's still being written) can decompress all of it.
+// Costs a few bytes and some compression, so don't call it too often.
+void gz_flush(struct Gz* g) {
+  deflate_write(g->z, NULL, 0, kDeflateSyncFlush);
+  gz_drain(g);
+  fflush(g->f);
 }
-int main() {
-  make_crc_table();
-
-  const unsigned char data[] = "Hello gzip\n";
-
-  // header
-  fputc(31, stdout);   // magic number 1
-  fputc(139, stdout);  // magic number 2
-  fputc(8, stdout);    // compression method: deflate
-  fputc(0, stdout);    // flags
-  fput_n_le(0, stdout, 4);  // mtime
-  fputc(0, stdout);    // extra flags
-  fputc(0xff, stdout); // OS
-
-  // data
-  fputc(1, stdout); // Final block, compression method: uncompressed
-  fput_n_le(sizeof(data), stdout, 2);
-  fput_n_le(~(uint16_t)sizeof(data), stdout, 2);
-  fwrite(data, 1, sizeof(data), stdout);
-
-  // footer
-  fput_n_le(crc(data, sizeof(data)), stdout, 4);  // crc32
-  fput_n_le(sizeof(data), stdout, 4);  // ISIZE
+
+void gz_end(struct Gz* g) {
+  deflate_write(g->z, NULL, 0, kDeflateFinish);
+  gz_drain(g);
+  deflate_free(g->z);
+  free(g->z);
+}
+
+int main(int argc, char* argv[]) {  // gz [level] < in > out.gz
+  struct Gz g;
+  gz_begin(&g, argc > 1 ? atoi(argv[1]) : 6, stdout);
+  static uint8_t buf[1 << 16];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0)
+    gz_write(&g, buf, n);
+  gz_end(&g);
 }
@@ -1,44 +1,389 @@
-/* Bare-bones png writer. Just uncompressed rgba png, no frills. Build like:
-     clang -o wpng wpng.c -Wall
+/* Bare-bones png writer. Just rgba png, no frills. Build like:
+     clang -o wpng wpng.c -Wall -lpthread
+   wpng() writes uncompressed data, wpng_level() filters scanlines with
+   pngfilter.h and compresses with deflate.h, level 1 (fastest) to 9
+   (smallest). wpng_begin(), wpng_write_rows(), wpng_end() do the same one
+   row at a time, and wpng_parallel() on several threads.
+   wpng_begin_color() writes gray, gray+alpha, rgb, or palette images, 8 or 16
+   bits per sample, and wpng_auto() picks the smallest of those that can hold
+   an rgba image.
 */
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 
+#include "checksum.h"
+#include "deflate.h"
+#include "pngfilter.h"
+
+static void wpng_chunk(const char* tag, const uint8_t* d, uint32_t len,
+                       FILE* f) {
+  uint8_t B[4] = { len >> 24, len >> 16, len >> 8, len };
+  fwrite(B, 1, 4, f); fwrite(tag, 1, 4, f);
+  if (len) fwrite(d, 1, len, f);
+  uint32_t crc = crc32_update(crc32_update(0, (const uint8_t*)tag, 4), d, len);
+  B[0] = crc >> 24; B[1] = crc >> 16; B[2] = crc >> 8; B[3] = crc;
+  fwrite(B, 1, 4, f);
+}
+
+enum WpngColor {  // png color types
+  kWpngGray = 0, kWpngRgb = 2, kWpngPalette = 3, kWpngGrayAlpha = 4,
+  kWpngRgba = 6,
+};
+
+static void wpng_ihdr(int w, int h, int depth, int color, FILE* f) {
+  uint8_t I[] = "\x89PNG\r\n\x1a\nwid0hyt0\x8\6\0\0\0";
+  for (int i = 0; i < 4; i++)
+    I[8 + i] = w >> (24 - 8*i), I[12 + i] = h >> (24 - 8*i);
+  I[16] = depth; I[17] = color;
+  fwrite(I, 1, 8, f);
+  wpng_chunk("IHDR", I + 8, 13, f);
+}
+
+// Stored zlib stream of known total size, split into IDAT chunks of at most
+// 1GB (the limit is 2^31 - 1) at arbitrary points.
+struct WpngIdat { FILE* f; uint64_t left; uint32_t chunk_left, crc; };
+
+static void wpng_idat_write(struct WpngIdat* c, const void* data, size_t n) {
+  const uint8_t* d = data;
+  uint8_t B[4];
+  while (n > 0) {
+    if (c->chunk_left == 0) {
+      c->chunk_left = c->left < 1 << 30 ? c->left : 1 << 30;
+      B[0] = c->chunk_left >> 24; B[1] = c->chunk_left >> 16;
+      B[2] = c->chunk_left >> 8; B[3] = c->chunk_left;
+      fwrite(B, 1, 4, c->f); fwrite("IDAT", 1, 4, c->f);
+      c->crc = crc32_update(0, (const uint8_t*)"IDAT", 4);
+    }
+    size_t k = n < c->chunk_left ? n : c->chunk_left;
+    fwrite(d, 1, k, c->f);
+    c->crc = crc32_update(c->crc, d, k);
+    d += k; n -= k; c->left -= k; c->chunk_left -= k;
+    if (c->chunk_left == 0) {
+      B[0] = c->crc >> 24; B[1] = c->crc >> 16; B[2] = c->crc >> 8;
+      B[3] = c->crc;
+      fwrite(B, 1, 4, c->f);
+    }
+  }
+}
+
 void wpng(int w, int h, const uint8_t* pix, FILE* f) {  // pix: rgba in memory
-  uint32_t crc_table[256], crc = ~0;
-  for (uint32_t n = 0, c = 0; n < 256; n++, c = n) {
-    for (int k = 0; k < 8; k++) c = -(c & 1) & 0xedb88320L ^ (c >> 1);
-    crc_table[n] = c;
-  }
-#define CRCWRITE(d, len) fwrite(d, 1, len, f); for (int n = 0; n < len; n++) \
-    crc = crc_table[(crc ^ (d)[n]) & 0xff] ^ (crc >> 8)
-#define U32BE(b, u) b[0] = (u)>>24; b[1] = (u)>>16; b[2] = (u)>>8; b[3] = (u)
-  uint8_t I[] = "\x89PNG\r\n\x1a\n\0\0\0\xdIHDRwid0hyt0\x8\6\0\0\0", B[4];
-  fwrite(I, 1, 12, f);
-  U32BE((I + 16), w); U32BE((I + 20), h); CRCWRITE(I+12, 17);
-  U32BE(B, ~crc); fwrite(B, 1, 4, f);  // IHDR crc32
-  uint16_t scanl = w*4 + 1;
-  U32BE(B, 6 + (5 + scanl)*h); fwrite(B, 1, 4, f);
-  crc = ~0; CRCWRITE("IDAT\x8\x1d", 6);
-  uint32_t a1 = 1, a2 = 0;
-  for (int y = 0; y < h; ++y, pix += w*4) {
-    uint8_t le[] = { y == h - 1, scanl, scanl >> 8, ~scanl, ~scanl >> 8, 0 };
-    CRCWRITE(le, 6);
-    CRCWRITE(pix, w*4);
-    const int P = 65521;
-    a2 = (a1 + a2) % P;
-    for (int n = 0; n < w*4; n++) { a1 = (a1+pix[n]) % P; a2 = (a1+a2) % P; }
-  }
-  U32BE(B, (a2 << 16) + a1); CRCWRITE(B, 4);  // adler32 of uncompressed data
-  U32BE(B, ~crc); fwrite(B, 1, 4, f);  // IDAT crc32
-#undef CRCWRITE
-#undef U32BE
-  fwrite("\0\0\0\0IEND\xae\x42\x60\x82", 1, 12, f);  // IEND + crc32
-}
-
-int main() {
+  wpng_ihdr(w, h, 8, kWpngRgba, f);
+  // Stored blocks hold at most 65535 bytes, so wide scanlines take several.
+  uint64_t scanl = (uint64_t)w*4 + 1, blocks = (scanl + 65534) / 65535;
+  struct WpngIdat c = { f, 2 + (scanl + 5*blocks)*h + 4, 0, 0 };
+  wpng_idat_write(&c, "\x8\x1d", 2);  // zlib header
+  uint32_t adler = 1;
+  for (int y = 0; y < h; ++y, pix += (size_t)w*4) {
+    for (uint64_t off = 0; off < scanl; off += 65535) {
+      uint16_t n = scanl - off < 65535 ? scanl - off : 65535;
+      uint8_t le[] = { y == h - 1 && off + n == scanl, n, n >> 8, ~n, ~n >> 8 };
+      wpng_idat_write(&c, le, 5);
+      if (off == 0)  // the first block starts with the filter byte, 0
+        wpng_idat_write(&c, "", 1), wpng_idat_write(&c, pix, n - 1);
+      else
+        wpng_idat_write(&c, pix + off - 1, n);
+    }
+    adler = adler32_update(adler, (const uint8_t*)"", 1);
+    adler = adler32_update(adler, pix, w*4);
+  }
+  uint8_t B[4] = { adler >> 24, adler >> 16, adler >> 8, adler };
+  wpng_idat_write(&c, B, 4);  // adler32 of uncompressed data
+  wpng_chunk("IEND", NULL, 0, f);
+}
+
+// Filter byte and filtered row y. scratch: 3*(w*4 + 1) bytes, the last third
+// zeroed (the "previous" row of the first row).
+static uint8_t* wpng_filter(const uint8_t* pix, int w, int y, int level,
+                            uint8_t* scratch) {
+  const uint8_t* row = pix + (size_t)y*w*4;
+  if (level > 0)
+    return png_filter_row(row, y ? row - w*4 : scratch + 2*(w*4 + 1), w*4, 4,
+                          scratch);
+  scratch[0] = kPngFilterNone;  // filtering doesn't help stored blocks
+  memcpy(scratch + 1, row, w*4);
+  return scratch;
+}
+
+// Writes IDAT chunks of at most 1MB.
+static void wpng_idat(const uint8_t* d, size_t n, FILE* f) {
+  for (size_t off = 0; off < n; off += 1 << 20)
+    wpng_chunk("IDAT", d + off, n - off < 1 << 20 ? n - off : 1 << 20, f);
+}
+
+// Streaming writer: call wpng_begin(), then wpng_write_rows() until all h
+// rows are written, then wpng_end(). Only keeps one row and the deflate
+// state in memory, and writes compressed data as it becomes available.
+struct Wpng {
+  FILE* f;
+  int w, h, y, level, color, depth, bpp;
+  size_t stride;  // bytes per row
+  struct Deflate* z;
+  uint8_t* scratch;  // 2 filtered rows
+  uint8_t* prev, *cur;  // previous row; current row, for 16 bit samples
+};
+
+// Like wpng_begin(), but rows passed to wpng_write_rows() have the given
+// color type (kWpng*) and bits per sample, 8 or 16. 16 bit samples are
+// native-endian uint16_ts. Palette images have 8 bit indices, and need a
+// wpng_plte() call before the first row.
+void wpng_begin_color(struct Wpng* p, int w, int h, int color, int depth,
+                      int level, FILE* f) {
+  static const int kChannels[7] = { 1, 0, 3, 1, 2, 0, 4 };
+  p->f = f; p->w = w; p->h = h; p->y = 0; p->level = level;
+  p->color = color; p->depth = depth;
+  p->bpp = kChannels[color] * depth / 8;
+  p->stride = (size_t)w * p->bpp;
+  wpng_ihdr(w, h, depth, color, f);
+  p->z = malloc(sizeof(*p->z));
+  deflate_init(p->z, level, kDeflateZlib);
+  p->scratch = malloc(2*(p->stride + 1));
+  p->prev = calloc(2, p->stride);  // "previous" row of the first row is 0
+  p->cur = p->prev + p->stride;
+}
+
+void wpng_begin(struct Wpng* p, int w, int h, int level, FILE* f) {
+  wpng_begin_color(p, w, h, kWpngRgba, 8, level, f);
+}
+
+// n rgba colors, in memory order. Writes PLTE, and tRNS if any color isn't
+// opaque.
+void wpng_plte(struct Wpng* p, const uint8_t* colors, int n) {
+  uint8_t rgb[3*256] = { 0 }, alpha[256];
+  int num_alpha = 0;
+  for (int i = 0; i < n; ++i) {
+    memcpy(rgb + 3*i, colors + 4*i, 3);
+    alpha[i] = colors[4*i + 3];
+    if (alpha[i] != 255) num_alpha = i + 1;  // trailing 255s can be left out
+  }
+  wpng_chunk("PLTE", rgb, 3*n, p->f);
+  if (num_alpha) wpng_chunk("tRNS", alpha, num_alpha, p->f);
+}
+
+void wpng_write_rows(struct Wpng* p, const uint8_t* rows, int n) {
+  size_t stride = p->stride;
+  for (int i = 0; i < n; ++i, ++p->y) {
+    const uint8_t* row = rows + i*stride, *prev = i ? row - stride : p->prev;
+    if (p->depth == 16) {  // png wants big-endian samples
+      for (size_t k = 0; k < stride; k += 2) {
+        uint16_t v;
+        memcpy(&v, row + k, 2);
+        p->cur[k] = v >> 8; p->cur[k + 1] = v;
+      }
+      row = p->cur;
+      prev = p->prev;
+    }
+    uint8_t* filtered = p->scratch;
+    // Filters don't help palette indices much, and the png spec suggests not
+    // using them there.
+    if (p->level > 0 && p->color != kWpngPalette) {
+      filtered = png_filter_row(row, prev, stride, p->bpp, p->scratch);
+    } else {  // filtering doesn't help stored blocks
+      filtered[0] = kPngFilterNone;
+      memcpy(filtered + 1, row, stride);
+    }
+    deflate_write(p->z, filtered, stride + 1, kDeflateNoFlush);
+    if (p->depth == 16) {  // this row is the next row's previous row
+      uint8_t* t = p->prev; p->prev = p->cur; p->cur = t;
+    }
+    // IDAT chunks can split the stream anywhere.
+    if (p->z->out_len >= 1 << 16) {
+      wpng_idat(p->z->out, p->z->out_len, p->f);
+      p->z->out_len = 0;
+    }
+  }
+  if (n > 0 && p->level > 0 && p->depth != 16)
+    memcpy(p->prev, rows + (n - 1)*stride, stride);  // rows might get reused
+}
+
+void wpng_end(struct Wpng* p) {
+  deflate_write(p->z, NULL, 0, kDeflateFinish);
+  wpng_idat(p->z->out, p->z->out_len, p->f);
+  deflate_free(p->z);
+  free(p->z);
+  free(p->scratch);
+  free(p->prev < p->cur ? p->prev : p->cur);
+  wpng_chunk("IEND", NULL, 0, p->f);
+}
+
+void wpng_level(int w, int h, const uint8_t* pix, int level, FILE* f) {
+  struct Wpng p;
+  wpng_begin(&p, w, h, level, f);
+  wpng_write_rows(&p, pix, h);
+  wpng_end(&p);
+}
+
+// Color counter for wpng_auto(): a hash table from rgba to palette index.
+struct WpngColors {
+  int n;  // 257: more than 256 colors
+  uint32_t colors[256];  // rgba, in memory order
+  uint32_t keys[1024];
+  int16_t index[1024];  // -1: empty
+};
+
+// Palette index of c, added if new. -1 if there are more than 256 colors.
+static int wpng_color_index(struct WpngColors* t, uint32_t c) {
+  uint32_t h = (c * 2654435761u) >> 22;
+  for (;; h = (h + 1) & 1023) {
+    if (t->index[h] < 0) break;
+    if (t->keys[h] == c) return t->index[h];
+  }
+  if (t->n >= 256) {
+    t->n = 257;
+    return -1;
+  }
+  t->keys[h] = c;
+  t->colors[t->n] = c;
+  return t->index[h] = t->n++;
+}
+
+// pix: rgba in memory. Writes gray if the image has only opaque grays, else a
+// palette image if it has at most 256 colors, else gray+alpha if it has only
+// grays, else rgb if it's opaque, else rgba.
+void wpng_auto(int w, int h, const uint8_t* pix, int level, FILE* f) {
+  struct WpngColors* t = malloc(sizeof(*t));
+  t->n = 0;
+  memset(t->index, 0xff, sizeof(t->index));
+  int gray = 1, opaque = 1;
+  uint32_t last = 0;
+  for (size_t i = 0; i < (size_t)w*h; ++i) {
+    uint32_t c;
+    memcpy(&c, pix + 4*i, 4);
+    if (i > 0 && c == last) continue;  // runs are common
+    last = c;
+    const uint8_t* q = pix + 4*i;
+    gray &= q[0] == q[1] && q[1] == q[2];
+    opaque &= q[3] == 255;
+    if (t->n <= 256) wpng_color_index(t, c);
+    if (!gray && !opaque && t->n > 256) break;  // needs rgba
+  }
+  int color = gray && opaque ? kWpngGray :
+              t->n <= 256 ? kWpngPalette :
+              gray ? kWpngGrayAlpha : opaque ? kWpngRgb : kWpngRgba;
+
+  struct Wpng p;
+  wpng_begin_color(&p, w, h, color, 8, level, f);
+  if (color == kWpngPalette) wpng_plte(&p, (const uint8_t*)t->colors, t->n);
+  if (color == kWpngRgba) {
+    wpng_write_rows(&p, pix, h);
+  } else {
+    uint8_t* rows = malloc(16 * p.stride);  // converted 16 rows at a time
+    for (int y = 0; y < h; y += 16) {
+      int n = h - y < 16 ? h - y : 16;
+      const uint8_t* q = pix + (size_t)y*w*4;
+      uint8_t* o = rows;
+      for (size_t i = 0; i < (size_t)n*w; ++i, q += 4) {
+        if (color == kWpngPalette) {
+          uint32_t c;
+          memcpy(&c, q, 4);
+          *o++ = wpng_color_index(t, c);
+        } else {
+          *o++ = q[0];
+          if (color == kWpngRgb) { *o++ = q[1]; *o++ = q[2]; }
+          if (color == kWpngGrayAlpha) *o++ = q[3];
+        }
+      }
+      wpng_write_rows(&p, rows, n);
+    }
+    free(rows);
+  }
+  wpng_end(&p);
+  free(t);
+}
+
+struct WpngBand {
+  const uint8_t* pix;
+  int w, y0, y1, level, first, last;
+  struct Deflate* z;
+  uint32_t adler;  // of this band's filtered rows
+  pthread_t thread;
+};
+
+static void* wpng_band(void* arg) {
+  struct WpngBand* b = arg;
+  size_t stride = b->w*4 + 1;
+  uint8_t* scratch = calloc(3, stride);
+  b->z = malloc(sizeof(*b->z));
+  // The first band writes the zlib header, the others are raw deflate.
+  deflate_init(b->z, b->level, b->first ? kDeflateZlib : kDeflateRaw);
+  if (b->y0 > 0) {  // Like pigz: match against the end of the previous band.
+    int n = (kDeflateWindow + stride - 1) / stride;
+    if (n > b->y0) n = b->y0;
+    uint8_t* dict = malloc(n * stride);
+    for (int i = 0; i < n; ++i)
+      memcpy(dict + i*stride,
+             wpng_filter(b->pix, b->w, b->y0 - n + i, b->level, scratch),
+             stride);
+    deflate_set_dictionary(b->z, dict, n * stride);
+    free(dict);
+  }
+  b->adler = 1;
+  for (int y = b->y0; y < b->y1; ++y) {
+    uint8_t* row = wpng_filter(b->pix, b->w, y, b->level, scratch);
+    b->adler = adler32_update(b->adler, row, stride);
+    deflate_write(b->z, row, stride, kDeflateNoFlush);
+  }
+  // A sync flush ends on a byte boundary without a final block, so the next
+  // band's data can just be appended.
+  deflate_write(b->z, NULL, 0, b->last ? kDeflateFinish : kDeflateSyncFlush);
+  free(scratch);
+  return NULL;
+}
+
+// Like wpng_level(), but compresses horizontal bands of the image on
+// separate threads. The output is a bit bigger.
+void wpng_parallel(int w, int h, const uint8_t* pix, int level, int threads,
+                   FILE* f) {
+  wpng_ihdr(w, h, 8, kWpngRgba, f);
+  if (threads > h) threads = h;
+  if (threads < 1) threads = 1;
+  struct WpngBand* bands = calloc(threads, sizeof(*bands));
+  for (int i = 0; i < threads; ++i) {
+    struct WpngBand* b = &bands[i];
+    b->pix = pix; b->w = w; b->level = level;
+    b->y0 = (int64_t)h*i / threads; b->y1 = (int64_t)h*(i + 1) / threads;
+    b->first = i == 0; b->last = i == threads - 1;
+    pthread_create(&b->thread, NULL, wpng_band, b);
+  }
+  uint32_t adler = 1;
+  for (int i = 0; i < threads; ++i) {
+    struct WpngBand* b = &bands[i];
+    pthread_join(b->thread, NULL);
+    uint64_t size = (uint64_t)(b->y1 - b->y0)*(w*4 + 1);
+    adler = wpng_adler32_combine(adler, b->adler, size);
+    if (b->last && !b->first) {  // single band: deflate.h wrote the adler32
+      uint8_t B[4] = { adler >> 24, adler >> 16, adler >> 8, adler };
+      deflate_put_bytes(b->z, B, 4);
+    }
+    wpng_idat(b->z->out, b->z->out_len, f);
+    deflate_free(b->z);
+    free(b->z);
+  }
+  free(bands);
+  wpng_chunk("IEND", NULL, 0, f);
+}
+
+// wpng [level [threads|s|a]] > out.png
+int main(int argc, char* argv[]) {
   uint8_t pix[256*125*4];
   for (size_t i = 0; i < sizeof(pix); ++i) pix[i] = i*i;
-  wpng(125, 256, pix, stdout);
+  if (argc > 2 && argv[2][0] == 's') {  // streaming, 3 rows at a time
+    struct Wpng p;
+    uint8_t rows[3*125*4];
+    wpng_begin(&p, 125, 256, atoi(argv[1]), stdout);
+    for (int y = 0; y < 256; y += 3) {
+      int n = 256 - y < 3 ? 256 - y : 3;
+      memcpy(rows, pix + y*125*4, n*125*4);
+      wpng_write_rows(&p, rows, n);
+    }
+    wpng_end(&p);
+  } else if (argc > 2 && argv[2][0] == 'a') {  // pick the color type
+    wpng_auto(125, 256, pix, atoi(argv[1]), stdout);
+  } else if (argc > 2)
+    wpng_parallel(125, 256, pix, atoi(argv[1]), atoi(argv[2]), stdout);
+  else if (argc > 1)
+    wpng_level(125, 256, pix, atoi(argv[1]), stdout);
+  else
+    wpng(125, 256, pix, stdout);
 }
@@ -0,0 +1,229 @@
+/*
+clang -O2 wpng/wpng_bench.c -o wpng_bench -lpthread
+
+Writes gradient, noise, and mandelbrot (from sse_mandel.c) images at several
+sizes with each writer in wpng/ to a temp file, and prints throughput in MB/s
+of uncompressed rgba data and the output size. Then times the stages of each
+writer on their own: checksums (adler32 of the zlib data and crc32 of the
+chunks), png filtering, compression, and writing the output. Stages a writer
+doesn't have are left blank.
+
+  wpng_bench [WxH ...]  # default: 640x480 1920x1080 4000x3000
+
+Widths are rounded up to a multiple of 4 for drawMandelbrot_sse().
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Pull in the writers, without their test mains. Renamed, those no longer
+// implicitly return 0.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wreturn-type"
+#define main wpng_main
+#include "wpng.c"
+#undef main
+#define main wtiff_main
+#include "wtiff.c"
+#undef main
+#define main wtga_main
+#include "wtga.c"
+#undef main
+#define main mandel_main
+#define wpng mandel_wpng  // sse_mandel.c has its own copy of the old wpng()
+#include "../sse_mandel.c"
+#undef wpng
+#undef main
+#pragma GCC diagnostic pop
+
+static double now(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void gradient(uint8_t* p, int w, int h) {
+  for (int y = 0; y < h; ++y)
+    for (int x = 0; x < w; ++x, p += 4) {
+      p[0] = x * 255 / w;
+      p[1] = y * 255 / h;
+      p[2] = (x + y) * 255 / (w + h);
+      p[3] = 255;
+    }
+}
+
+static void noise(uint8_t* p, int w, int h) {
+  uint32_t r = 2463534242u;  // xorshift
+  for (size_t i = 0; i < (size_t)w * h * 4; ++i) {
+    r ^= r << 13; r ^= r >> 17; r ^= r << 5;
+    p[i] = r;
+  }
+}
+
+static void mandel(uint8_t* p, int w, int h) {
+  drawMandelbrot_sse((uint32_t*)p, w, h);  // 0xffiiiiii: gray, opaque
+}
+
+enum { kPng, kTiff, kTga };
+
+struct Writer {
+  const char* name;
+  int format, level, compression;
+};
+
+static const struct Writer writers[] = {
+  { "png stored", kPng, 0, 0 },
+  { "png level 1", kPng, 1, 0 },
+  { "png level 6", kPng, 6, 0 },
+  { "tiff none", kTiff, 0, kTiffNone },
+  { "tiff packbits", kTiff, 0, kTiffPackBits },
+  { "tiff lzw", kTiff, 0, kTiffLzw },
+  { "tiff deflate", kTiff, 6, kTiffDeflate },
+  { "tga", kTga, 0, 0 },
+};
+
+static void write_image(const struct Writer* wr, int w, int h,
+                        const uint8_t* pix, FILE* f) {
+  if (wr->format == kPng) {
+    if (wr->level > 0)
+      wpng_level(w, h, pix, wr->level, f);
+    else
+      wpng(w, h, pix, f);
+  } else if (wr->format == kTiff) {
+    struct WtiffOptions o = { wr->compression, wr->level, 0, 0, 1, -1 };
+    wtiff_opt(w, h, pix, &o, f);
+  } else {
+    wtga(w, h, pix, f);  // really rgba, top row first, but just as fast
+  }
+}
+
+// Best of at least one run and 0.5s. Returns seconds, and the output size.
+static double bench_write(const struct Writer* wr, int w, int h,
+                          const uint8_t* pix, long* size) {
+  double best = 1e30, total = 0;
+  for (int run = 0; run < 1 || total < 0.5; ++run) {
+    double start = now();
+    FILE* f = tmpfile();
+    write_image(wr, w, h, pix, f);
+    fflush(f);
+    double t = now() - start;
+    *size = ftell(f);
+    fclose(f);
+    if (t < best) best = t;
+    total += t;
+  }
+  return best;
+}
+
+struct Stages { double checksum, filter, compress, io; };  // <0: not used
+
+static double write_out(const uint8_t* d, size_t n) {
+  double start = now();
+  FILE* f = tmpfile();
+  fwrite(d, 1, n, f);
+  fflush(f);
+  double t = now() - start;
+  fclose(f);
+  return t;
+}
+
+// Runs each stage of the writer on its own, once.
+static struct Stages bench_stages(const struct Writer* wr, int w, int h,
+                                  const uint8_t* pix) {
+  struct Stages s = { -1, -1, -1, -1 };
+  size_t n = (size_t)w * h * 4;
+  if (wr->format == kTga) {
+    s.io = write_out(pix, n);
+  } else if (wr->format == kTiff) {
+    struct WtiffOptions o = { wr->compression, wr->level, 0, 0, 1, -1 };
+    int rows = 65536 / (w*4 + 1) + 1;  // wtiff_opt()'s default strip size
+    struct TiffBuf b = { NULL, 0, 0 };
+    double start = now();
+    for (int y = 0; y < h; y += rows)
+      tiff_encode(&o, pix + (size_t)y * w * 4, (size_t)w * 4,
+                  h - y < rows ? h - y : rows, (size_t)w * 4, &b);
+    s.compress = now() - start;
+    s.io = write_out(b.d, b.len);
+    free(b.d);
+  } else {
+    size_t stride = (size_t)w * 4 + 1;
+    uint8_t* rows = malloc(stride * h);
+    uint8_t* scratch = calloc(3, stride);
+    double start = now();
+    for (int y = 0; y < h; ++y)
+      memcpy(rows + y * stride, wpng_filter(pix, w, y, wr->level, scratch),
+             stride);
+    if (wr->level > 0) s.filter = now() - start;
+
+    const uint8_t* out = rows;
+    size_t out_len = stride * h;
+    struct Deflate* z = malloc(sizeof(*z));
+    deflate_init(z, wr->level, kDeflateRaw);  // raw: no adler32 in here
+    start = now();
+    deflate_write(z, rows, stride * h, kDeflateFinish);
+    if (wr->level > 0) {
+      s.compress = now() - start;
+      out = z->out;
+      out_len = z->out_len;
+    }
+
+    start = now();
+    volatile uint32_t sink = adler32_update(1, rows, stride * h);
+    sink = crc32_update(0, out, out_len);
+    (void)sink;
+    s.checksum = now() - start;
+
+    s.io = write_out(out, out_len);
+    deflate_free(z);
+    free(z);
+    free(scratch);
+    free(rows);
+  }
+  return s;
+}
+
+static void print_ms(double t) {
+  if (t < 0) printf("%9s", "");
+  else printf("%9.1f", t * 1e3);
+}
+
+int main(int argc, char* argv[]) {
+  const char* default_sizes[] = { "640x480", "1920x1080", "4000x3000" };
+  const char** sizes = argc > 1 ? (const char**)argv + 1 : default_sizes;
+  int num_sizes = argc > 1 ? argc - 1 : 3;
+  struct { const char* name; void (*draw)(uint8_t*, int, int); } images[] = {
+    { "gradient", gradient }, { "noise", noise }, { "mandelbrot", mandel },
+  };
+  crc32_init();
+
+  printf("%-10s %-10s %-14s %8s %11s |%9s%9s%9s%9s  (ms)\n", "image", "size",
+         "writer", "MB/s", "bytes", "checksum", "filter", "compress", "io");
+  for (int i = 0; i < num_sizes; ++i) {
+    int w = 0, h = 0;
+    if (sscanf(sizes[i], "%dx%d", &w, &h) != 2 || w <= 0 || h <= 0) {
+      fprintf(stderr, "bad size %s, want WxH\n", sizes[i]);
+      return 1;
+    }
+    w = (w + 3) & ~3;
+    size_t n = (size_t)w * h * 4;
+    uint8_t* pix = aligned_alloc(16, n);  // n is a multiple of 16
+    for (size_t k = 0; k < sizeof(images) / sizeof(images[0]); ++k) {
+      images[k].draw(pix, w, h);
+      char size[32];
+      snprintf(size, sizeof(size), "%dx%d", w, h);
+      for (size_t j = 0; j < sizeof(writers) / sizeof(writers[0]); ++j) {
+        const struct Writer* wr = &writers[j];
+        if (wr->format == kTga && (w > 65535 || h > 65535)) continue;
+        long bytes;
+        double t = bench_write(wr, w, h, pix, &bytes);
+        struct Stages s = bench_stages(wr, w, h, pix);
+        printf("%-10s %-10s %-14s %8.1f %11ld |", images[k].name, size,
+               wr->name, n / 1e6 / t, bytes);
+        print_ms(s.checksum); print_ms(s.filter);
+        print_ms(s.compress); print_ms(s.io);
+        printf("\n");
+      }
+    }
+    free(pix);
+  }
+}
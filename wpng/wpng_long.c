@@ -1,44 +1,23 @@
 /*
 
-Bare-bones png writer. Just uncompressed rgba png, no frills. Build like:
+Bare-bones png writer. Just rgba png, no frills. Build like:
 
   clang -o wpng wpng.c -Wall
 
+wpng() writes uncompressed data, wpng_level() filters it with pngfilter.h
+and compresses it with deflate.h.
+
 */
 
 #include <stdint.h>
 #include <stdio.h>
 
-unsigned long crc_table[256];
-void make_crc_table(void) {
-  for (int n = 0; n < 256; n++) {
-    unsigned long c = (unsigned long) n;
-    for (int k = 0; k < 8; k++)
-      if (c & 1)
-        c = 0xedb88320L ^ (c >> 1);
-      else
-        c = c >> 1;
-    crc_table[n] = c;
-  }
-}
-unsigned long update_crc(unsigned long crc, const unsigned char *buf, int len) {
-  unsigned long c = crc;
-  for (int n = 0; n < len; n++)
-    c = crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
-  return c;
-}
+#include "checksum.h"
+#include "deflate.h"
+#include "pngfilter.h"
 
-unsigned long update_adler32(unsigned long adler,
-                             const unsigned char *buf, int len) {
-  const int BASE = 65521; /* largest prime smaller than 65536 */
-  unsigned long s1 = adler & 0xffff;
-  unsigned long s2 = (adler >> 16) & 0xffff;
-  for (int n = 0; n < len; n++) {
-    s1 = (s1 + buf[n]) % BASE;
-    s2 = (s2 + s1)     % BASE;
-  }
-  return (s2 << 16) + s1;
-}
+// crc32_update() and adler32_update() are in checksum.h, shared with wpng.c
+// and gz.c.
 
 void fput_n_be(uint32_t u, FILE* f, int n) {
   for (int i = 0; i < n; i++) fputc((u << (8*i)) >> 24, f);
@@ -51,7 +30,7 @@ typedef struct {
 
 void pngblock_write(const void* d, int n, pngblock* b) {
   fwrite(d, 1, n, b->f);
-  b->crc = update_crc(b->crc, d, n);
+  b->crc = crc32_update(b->crc, d, n);
 }
 
 void pngblock_start(pngblock* b, uint32_t size, const char* tag) {
@@ -62,26 +41,78 @@ void pngblock_start(pngblock* b, uint32_t size, const char* tag) {
   // uint32_t crc code (including type and data, but not length)
 
   fput_n_be(size, b->f, 4);
-  b->crc = 0xffffffff;
+  b->crc = 0;
   pngblock_write(tag, 4, b);
 }
 
 void pngblock_putc(int c, pngblock* b) {
   fputc(c, b->f);
   unsigned char c8 = c;
-  b->crc = update_crc(b->crc, &c8, 1);
+  b->crc = crc32_update(b->crc, &c8, 1);
 }
 
 void pngblock_put_n_be(uint32_t u, pngblock* b, int n) {
   for (int i = 0; i < n; i++) pngblock_putc((u << (8*i)) >> 24, b);
 }
-void pngblock_put_n_le(uint32_t u, pngblock* b, int n) {
-  for (int i = 0; i < n; i++) pngblock_putc(u >> (8*i), b);
-}
 
 void pngblock_end(pngblock* b) {
-  uint32_t crc32 = b->crc ^ 0xffffffff;
-  fput_n_be(crc32, b->f, 4);
+  fput_n_be(b->crc, b->f, 4);
+}
+
+void write_header(int w, int h, pngblock* b) {
+  const char header[] = "\x89PNG\r\n\x1a\n";
+  fwrite(header, 1, 8, b->f);
+
+  // header
+  pngblock_start(b, 13, "IHDR");  // size: IHDR has two uint32 + 5 bytes = 13
+  pngblock_put_n_be(w, b, 4);
+  pngblock_put_n_be(h, b, 4);
+  pngblock_putc(8, b);  // bits per channel
+  pngblock_putc(6, b);  // color type: truecolor rgba
+  pngblock_putc(0, b);  // compression method: deflate
+  pngblock_putc(0, b);  // filter method: 1 byte subfilter before each scanline
+  pngblock_putc(0, b);  // interlace method: no interlace
+  pngblock_end(b);  // IHDR crc32
+}
+
+// A png image's zlib stream can be split into several IDAT chunks (see the
+// quote in wpng()). A chunk holds at most 2^31 - 1 bytes, so big images need
+// several. idat_writer writes a zlib stream of known size, and starts a new
+// IDAT chunk whenever the current one is full.
+typedef struct {
+  pngblock b;
+  uint64_t left;  // bytes left in the zlib stream
+  uint32_t chunk_left;  // bytes left in the current IDAT chunk
+} idat_writer;
+
+void idat_write(const void* d, uint64_t n, idat_writer* w) {
+  const uint8_t* p = d;
+  while (n > 0) {
+    if (w->chunk_left == 0) {
+      w->chunk_left = w->left < (1u << 30) ? w->left : (1u << 30);
+      pngblock_start(&w->b, w->chunk_left, "IDAT");
+    }
+    uint32_t k = n < w->chunk_left ? n : w->chunk_left;
+    pngblock_write(p, k, &w->b);
+    p += k;
+    n -= k;
+    w->left -= k;
+    w->chunk_left -= k;
+    if (w->chunk_left == 0)
+      pngblock_end(&w->b);  // IDAT crc32
+  }
+}
+
+void idat_putc(int c, idat_writer* w) {
+  unsigned char c8 = c;
+  idat_write(&c8, 1, w);
+}
+
+void idat_put_n_be(uint32_t u, idat_writer* w, int n) {
+  for (int i = 0; i < n; i++) idat_putc((u << (8*i)) >> 24, w);
+}
+void idat_put_n_le(uint32_t u, idat_writer* w, int n) {
+  for (int i = 0; i < n; i++) idat_putc(u >> (8*i), w);
 }
 
 // XXX or char*?
@@ -90,38 +121,26 @@ void wpng(int w, int h, unsigned* pix, FILE* f) {
   // http://www.libpng.org/pub/png/spec/1.2/PNG-Contents.html
   // http://www.w3.org/TR/PNG/
 
-  const char header[] = "\x89PNG\r\n\x1a\n";
-  fwrite(header, 1, 8, f);
-
-  make_crc_table();
-
-  // header
   pngblock b = { f };
-  pngblock_start(&b, 13, "IHDR");  // size: IHDR has two uint32 + 5 bytes = 13
-  pngblock_put_n_be(w, &b, 4);
-  pngblock_put_n_be(h, &b, 4);
-  pngblock_putc(8, &b);  // bits per channel
-  pngblock_putc(6, &b);  // color type: truecolor rgba
-  pngblock_putc(0, &b);  // compression method: deflate
-  pngblock_putc(0, &b);  // filter method: 1 byte subfilter before each scanline
-  pngblock_putc(0, &b);  // interlace method: no interlace
-  pngblock_end(&b);  // IHDR crc32
+  write_header(w, h, &b);
 
   // image data
   // the uncompressed "size" field for a zlib stream is just 2 byte. to
-  // support images bigger than 65kB, use one zlib stream block per scanline.
-  // 65kB per scanline should be enough for everybody.
-  uint32_t scanline_size = 0;
-  scanline_size += w * 4;  // image data
+  // support images bigger than 65kB, use one zlib stream block per scanline,
+  // and several blocks for scanlines longer than 65535 bytes (images wider
+  // than 16383 pixels).
+  uint64_t scanline_size = 0;
+  scanline_size += (uint64_t)w * 4;  // image data
   scanline_size += 1;  // one filter byte per scanline
+  uint64_t blocks_per_scanline = (scanline_size + 65534) / 65535;
 
-  uint32_t idat_size = 0;
+  uint64_t idat_size = 0;
   idat_size += 2;  // zlib header
-  idat_size += (1 + 2 + 2) * h;  // uncompressed data block header
+  idat_size += (1 + 2 + 2) * blocks_per_scanline * h;  // stored block headers
   idat_size += scanline_size * h;
   idat_size += 4;  // adler32 of compressed data
 
-  pngblock_start(&b, idat_size, "IDAT");
+  idat_writer idat = { { f }, idat_size, 0 };
   // IDAT
   // zlib format:
   // http://www.ietf.org/rfc/rfc1950.txt
@@ -147,32 +166,97 @@ void wpng(int w, int h, unsigned* pix, FILE* f) {
   //    (Of course, some encoder implementations may emit files in which some
   //    of these structures are indeed related. But decoders cannot rely on
   //    this.)"""
-  pngblock_putc(0x08, &b);  // zlib compression method (8: deflate) and
-                            // window size (0: 256 bytes, as small as possible)
-  pngblock_putc(29, &b);  // flags. previous byte * 256 + this % 31 should be 0
+  idat_putc(0x08, &idat);  // zlib compression method (8: deflate) and
+                          // window size (0: 256 bytes, as small as possible)
+  idat_putc(29, &idat);  // flags. previous byte * 256 + this % 31 should be 0
 
   // zlib data
   uint32_t adler = 1;
   for (int y = 0; y < h; ++y) {
-    pngblock_putc(y == h - 1 ? 1 : 0, &b); // Final block?
-    pngblock_put_n_le(scanline_size, &b, 2);
-    pngblock_put_n_le(~scanline_size, &b, 2);
     const uint8_t zero = 0;
-    pngblock_putc(zero, &b);  // Filter used for this scanline
-    adler = update_adler32(adler, &zero, 1);
-    pngblock_write(pix + y*w, 4*w, &b);  // XXX endianess
-    adler = update_adler32(adler, (uint8_t*)(pix + y*w), 4*w);
+    const uint8_t* row = (uint8_t*)(pix + (size_t)y*w);  // XXX endianess
+    for (uint64_t off = 0; off < scanline_size; off += 65535) {
+      uint64_t left = scanline_size - off;
+      uint32_t block_size = left < 65535 ? left : 65535;
+      idat_putc(y == h - 1 && block_size == left, &idat); // Final block?
+      idat_put_n_le(block_size, &idat, 2);
+      idat_put_n_le(~block_size, &idat, 2);
+      if (off == 0) {
+        idat_putc(zero, &idat);  // Filter used for this scanline
+        idat_write(row, block_size - 1, &idat);
+      } else {
+        idat_write(row + off - 1, block_size, &idat);
+      }
+    }
+    adler = adler32_update(adler, &zero, 1);
+    adler = adler32_update(adler, row, 4*(size_t)w);
   }
 
-  pngblock_put_n_be(adler, &b, 4);  // adler32 of uncompressed data
+  idat_put_n_be(adler, &idat, 4);  // adler32 of uncompressed data
+                                   // (idat_write() wrote the last IDAT crc32)
+
+  // footer
+  pngblock_start(&b, 0, "IEND");
+  pngblock_end(&b);  // IEND crc32
+}
+
+// Like wpng(), but compresses the image data. level goes from 1 (fastest) to
+// 9 (smallest), see deflate.h.
+void wpng_level(int w, int h, unsigned* pix, int level, FILE* f) {
+  pngblock b = { f };
+  write_header(w, h, &b);
+
+  // deflate.h writes the zlib header, compressed blocks, and the adler32.
+  // The compressed size isn't known upfront, but the image data can be split
+  // into several IDAT chunks at arbitrary points (see the quote in wpng()),
+  // so write a chunk whenever enough compressed data is ready.
+  struct Deflate* z = malloc(sizeof(*z));
+  deflate_init(z, level, kDeflateZlib);
+
+  // Each scanline starts with a filter byte. Filters replace each byte with
+  // its difference to a prediction from the pixel to the left, the pixel
+  // above, or both. Smooth images turn into lots of small numbers that
+  // compress much better. The filter is picked per scanline, see
+  // pngfilter.h. The first row is filtered against a row of zeros.
+  uint8_t* scratch = malloc(2 * (4*w + 1));
+  uint8_t* zero_row = calloc(4*w, 1);
+  for (int y = 0; y < h; ++y) {
+    const uint8_t* row = (uint8_t*)(pix + (size_t)y*w);  // XXX endianess
+    const uint8_t* prev = y ? (uint8_t*)(pix + (size_t)(y - 1)*w) : zero_row;
+    const uint8_t* filtered = level > 0 ?
+        png_filter_row(row, prev, 4*w, 4, scratch) : NULL;
+    if (filtered) {
+      deflate_write(z, filtered, 4*w + 1, kDeflateNoFlush);
+    } else {  // level 0 stores the data, filtering wouldn't help
+      const uint8_t zero = 0;
+      deflate_write(z, &zero, 1, kDeflateNoFlush);  // Filter for this scanline
+      deflate_write(z, row, 4*w, kDeflateNoFlush);
+    }
+    if (z->out_len >= 1 << 16) {
+      pngblock_start(&b, z->out_len, "IDAT");
+      pngblock_write(z->out, z->out_len, &b);
+      pngblock_end(&b);  // IDAT crc32
+      z->out_len = 0;
+    }
+  }
+  deflate_write(z, NULL, 0, kDeflateFinish);
+  pngblock_start(&b, z->out_len, "IDAT");
+  pngblock_write(z->out, z->out_len, &b);
   pngblock_end(&b);  // IDAT crc32
+  deflate_free(z);
+  free(z);
+  free(scratch);
+  free(zero_row);
 
   // footer
   pngblock_start(&b, 0, "IEND");
   pngblock_end(&b);  // IEND crc32
 }
 
-int main() {
+int main(int argc, char* argv[]) {  // wpng [level] > out.png
   unsigned pix[] = { 0xff0000ff, 0xff00ff00, 0xffff0000, 0x8000ff00 };
-  wpng(2, 2, pix, stdout);
+  if (argc > 1)
+    wpng_level(2, 2, pix, atoi(argv[1]), stdout);
+  else
+    wpng(2, 2, pix, stdout);
 }
@@ -1,9 +1,18 @@
-/* Bare-bones tiff writer. Just uncompressed rgba tiffs. Build like:
-     clang -o wtiff wtiff.c -Wall
+/* Bare-bones tiff writer. Build like:
+     clang -o wtiff wtiff.c -Wall -lpthread
+   wtiff() writes uncompressed rgba tiffs. wtiff_opt() writes strips or tiles,
+   optionally PackBits, LZW, or Deflate compressed on several threads, and
+   BigTIFF for files over 4GB.
 */
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "deflate.h"
 
 void wtiff(int w, int h, const uint8_t* pix, FILE* f) {  // pix: rgba in memory
   union { uint16_t i; uint8_t c[2]; } endian_check = {42};
@@ -90,12 +99,361 @@ void wtiff(int w, int h, const uint8_t* pix, FILE* f) {  // pix: rgba in memory
   fwrite(pix, 4, w*h, f);
 }
 
-int main() {
+enum {  // values of the compression tag
+  kTiffNone = 1, kTiffLzw = 5, kTiffDeflate = 8, kTiffPackBits = 32773,
+};
+
+struct WtiffOptions {
+  int compression;     // kTiff*
+  int level;           // deflate level, 1-9
+  int tile_size;       // 0: strips, else square tiles; a multiple of 16
+  int rows_per_strip;  // 0: about 64kB per strip
+  int threads;
+  int bigtiff;         // 0: no, 1: yes, -1: if the file might be over 4GB
+};
+
+struct TiffBuf { uint8_t* d; size_t len, cap; };
+
+static void tiffbuf_put(struct TiffBuf* b, const void* p, size_t n) {
+  if (b->len + n > b->cap) {
+    b->cap = 2 * b->cap + n;
+    b->d = realloc(b->d, b->cap);
+  }
+  memcpy(b->d + b->len, p, n);
+  b->len += n;
+}
+
+static void tiffbuf_putc(struct TiffBuf* b, uint8_t c) {
+  tiffbuf_put(b, &c, 1);
+}
+
+// Runs of 3 to 128 equal bytes become 1 - length and the byte, everything
+// else is copied in literal runs of up to 128 bytes after length - 1.
+// "Each row must be packed separately."
+static void packbits_row(struct TiffBuf* b, const uint8_t* p, size_t n) {
+  for (size_t i = 0; i < n; ) {
+    size_t run = 1;
+    while (i + run < n && run < 128 && p[i + run] == p[i]) run++;
+    if (run >= 3) {
+      tiffbuf_putc(b, (uint8_t)(1 - (int)run));
+      tiffbuf_putc(b, p[i]);
+      i += run;
+      continue;
+    }
+    size_t lit = 0;  // up to the next run of 3
+    while (i + lit < n && lit < 128 &&
+           !(i + lit + 2 < n && p[i + lit] == p[i + lit + 1] &&
+             p[i + lit] == p[i + lit + 2]))
+      lit++;
+    tiffbuf_putc(b, lit - 1);
+    tiffbuf_put(b, p + i, lit);
+    i += lit;
+  }
+}
+
+// TIFF flavored LZW, like libtiff writes it: codes are written msb first,
+// starting at 9 bits and growing up to 12; 256 clears the table and 257 ends
+// the strip. The table is a hash of (prefix code, next byte).
+struct Lzw {
+  struct TiffBuf* b;
+  uint32_t bitbuf;
+  int bits, width, next;
+  int32_t keys[1 << 13];  // 2x the 4096 codes, -1: empty
+  uint16_t codes[1 << 13];
+};
+
+static void lzw_put(struct Lzw* z, int code) {
+  z->bitbuf = z->bitbuf << z->width | code;
+  z->bits += z->width;
+  while (z->bits >= 8) {
+    z->bits -= 8;
+    tiffbuf_putc(z->b, z->bitbuf >> z->bits);
+  }
+}
+
+static void lzw_clear(struct Lzw* z) {
+  lzw_put(z, 256);
+  memset(z->keys, 0xff, sizeof(z->keys));
+  z->width = 9;
+  z->next = 258;
+}
+
+// Called after each code written for a new table entry.
+static void lzw_grow(struct Lzw* z) {
+  if (++z->next == 4094)
+    lzw_clear(z);
+  else if (z->next > (1 << z->width) - 1)
+    z->width++;
+}
+
+static void lzw_encode(struct TiffBuf* b, const uint8_t* p, size_t n) {
+  struct Lzw* z = malloc(sizeof(*z));
+  z->b = b; z->bitbuf = 0; z->bits = 0; z->width = 9;
+  lzw_clear(z);
+  if (n > 0) {
+    int prefix = p[0];
+    for (size_t i = 1; i < n; ++i) {
+      int32_t key = prefix << 8 | p[i];
+      uint32_t h = (key * 2654435761u) >> 19;
+      while (z->keys[h] >= 0 && z->keys[h] != key)
+        h = (h + 1) & ((1 << 13) - 1);
+      if (z->keys[h] == key) {
+        prefix = z->codes[h];
+        continue;
+      }
+      lzw_put(z, prefix);
+      z->keys[h] = key;
+      z->codes[h] = z->next;
+      lzw_grow(z);
+      prefix = p[i];
+    }
+    lzw_put(z, prefix);
+    // The decoder adds a table entry for this code too, and might switch to
+    // wider codes before reading the end code.
+    lzw_grow(z);
+  }
+  lzw_put(z, 257);
+  if (z->bits > 0)
+    tiffbuf_putc(b, z->bitbuf << (8 - z->bits));
+  free(z);
+}
+
+// Encodes rows of n bytes each, with stride bytes between rows.
+static void tiff_encode(const struct WtiffOptions* o, const uint8_t* p,
+                        size_t n, int rows, size_t stride, struct TiffBuf* b) {
+  if (o->compression == kTiffPackBits) {
+    for (int y = 0; y < rows; ++y) packbits_row(b, p + y*stride, n);
+    return;
+  }
+  // The other compressions work on the whole segment, so make it contiguous.
+  uint8_t* tmp = NULL;
+  if (stride != n && rows > 1) {
+    tmp = malloc(n * rows);
+    for (int y = 0; y < rows; ++y) memcpy(tmp + y*n, p + y*stride, n);
+    p = tmp;
+  }
+  if (o->compression == kTiffLzw) {
+    lzw_encode(b, p, n * rows);
+  } else if (o->compression == kTiffDeflate) {
+    struct Deflate* z = malloc(sizeof(*z));
+    deflate_init(z, o->level, kDeflateZlib);
+    deflate_write(z, p, n * rows, kDeflateFinish);
+    tiffbuf_put(b, z->out, z->out_len);
+    deflate_free(z);
+    free(z);
+  } else {
+    tiffbuf_put(b, p, n * rows);
+  }
+  free(tmp);
+}
+
+// Segments (strips or tiles) are encoded by worker threads and written in
+// order by the calling thread. Workers stay at most 2 * threads segments
+// ahead of the writer, which bounds memory use.
+struct WtiffJob {
+  const uint8_t* pix;
+  int w, h, seg_w, seg_h, across, num_segs;
+  int threads;  // o->threads, at least 1
+  const struct WtiffOptions* o;
+  struct TiffBuf* out;
+  int* done;
+  int next, written;
+  pthread_mutex_t mu;
+  pthread_cond_t cv;
+};
+
+static void wtiff_segment(struct WtiffJob* j, int i, struct TiffBuf* b) {
+  int x0 = (i % j->across) * j->seg_w, y0 = (i / j->across) * j->seg_h;
+  const uint8_t* p = j->pix + ((size_t)y0 * j->w + x0) * 4;
+  if (!j->o->tile_size) {  // strips: full rows, the last strip can be short
+    int rows = j->h - y0 < j->seg_h ? j->h - y0 : j->seg_h;
+    tiff_encode(j->o, p, (size_t)j->w * 4, rows, (size_t)j->w * 4, b);
+    return;
+  }
+  // Tiles always have the full tile size; pad edge tiles with zeros.
+  int tw = j->w - x0 < j->seg_w ? j->w - x0 : j->seg_w;
+  int th = j->h - y0 < j->seg_h ? j->h - y0 : j->seg_h;
+  size_t n = (size_t)j->seg_w * 4;
+  uint8_t* tile = calloc(n, j->seg_h);
+  for (int y = 0; y < th; ++y)
+    memcpy(tile + y*n, p + (size_t)y * j->w * 4, (size_t)tw * 4);
+  tiff_encode(j->o, tile, n, j->seg_h, n, b);
+  free(tile);
+}
+
+static void* wtiff_worker(void* arg) {
+  struct WtiffJob* j = arg;
+  for (;;) {
+    pthread_mutex_lock(&j->mu);
+    while (j->next < j->num_segs &&
+           j->next >= j->written + 2 * j->threads)
+      pthread_cond_wait(&j->cv, &j->mu);
+    int i = j->next++;
+    pthread_mutex_unlock(&j->mu);
+    if (i >= j->num_segs)
+      return NULL;
+    struct TiffBuf b = { NULL, 0, 0 };
+    wtiff_segment(j, i, &b);
+    pthread_mutex_lock(&j->mu);
+    j->out[i] = b;
+    j->done[i] = 1;
+    pthread_cond_broadcast(&j->cv);
+    pthread_mutex_unlock(&j->mu);
+  }
+}
+
+// Appends an ifd entry to ifd, and its values to ext if they don't fit into
+// the entry. Values are native-endian, like the rest of the file.
+static void tiff_entry(struct TiffBuf* ifd, struct TiffBuf* ext,
+                       uint64_t ext_pos, int bigtiff, uint16_t tag,
+                       uint16_t type, uint64_t count, const void* values) {
+  int size = type == 3 ? 2 : type == 4 ? 4 : 8;  // short, long, long8
+  uint64_t bytes = size * count, off = ext_pos + ext->len;
+  uint32_t count32 = count, off32 = off;
+  int inline_size = bigtiff ? 8 : 4;
+  tiffbuf_put(ifd, &tag, 2);
+  tiffbuf_put(ifd, &type, 2);
+  if (bigtiff) tiffbuf_put(ifd, &count, 8); else tiffbuf_put(ifd, &count32, 4);
+  if (bytes <= (uint64_t)inline_size) {
+    uint8_t v[8] = { 0 };
+    memcpy(v, values, bytes);
+    tiffbuf_put(ifd, v, inline_size);
+    return;
+  }
+  if (bigtiff) tiffbuf_put(ifd, &off, 8); else tiffbuf_put(ifd, &off32, 4);
+  tiffbuf_put(ext, values, bytes);
+  if (ext->len & 1) tiffbuf_putc(ext, 0);  // offsets should be even
+}
+
+// f must be seekable: the offset of the ifd is patched into the header last.
+void wtiff_opt(int w, int h, const uint8_t* pix, const struct WtiffOptions* o,
+               FILE* f) {
+  struct WtiffJob j = { .pix = pix, .w = w, .h = h, .o = o };
+  if (o->tile_size) {
+    j.seg_w = j.seg_h = o->tile_size;
+  } else {
+    j.seg_w = w;
+    j.seg_h = o->rows_per_strip ? o->rows_per_strip : 65536 / (w*4 + 1) + 1;
+    if (j.seg_h > h) j.seg_h = h;
+  }
+  j.across = (w + j.seg_w - 1) / j.seg_w;
+  j.num_segs = j.across * ((h + j.seg_h - 1) / j.seg_h);
+  // LZW can grow random data by up to 1.5x.
+  uint64_t worst = (uint64_t)j.num_segs * (j.seg_w * j.seg_h * 6ull + 64);
+  int bigtiff = o->bigtiff >= 0 ? o->bigtiff : worst > 0xffffff00u;
+
+  union { uint16_t i; uint8_t c[2]; } endian_check = {42};
+  off_t base = ftello(f);
+  fwrite(endian_check.c[0] == 0 ? "MM" : "II", 1, 2, f);
+  uint16_t magic[3] = { 43, 8, 0 };  // BigTIFF: 43, offset size, 0
+  uint64_t ifd_pos = 0, pos = bigtiff ? 16 : 8;
+  fwrite(bigtiff ? magic : &endian_check.i, 2, bigtiff ? 3 : 1, f);
+  fwrite(&ifd_pos, bigtiff ? 8 : 4, 1, f);  // patched below
+
+  j.out = calloc(j.num_segs, sizeof(*j.out));
+  j.done = calloc(j.num_segs, sizeof(*j.done));
+  uint64_t* offsets = malloc(j.num_segs * sizeof(*offsets));
+  uint64_t* sizes = malloc(j.num_segs * sizeof(*sizes));
+  pthread_mutex_init(&j.mu, NULL);
+  pthread_cond_init(&j.cv, NULL);
+  j.threads = o->threads > 0 ? o->threads : 1;
+  pthread_t* workers = malloc(j.threads * sizeof(*workers));
+  for (int i = 0; i < j.threads; ++i)
+    pthread_create(&workers[i], NULL, wtiff_worker, &j);
+  for (int i = 0; i < j.num_segs; ++i) {
+    pthread_mutex_lock(&j.mu);
+    while (!j.done[i]) pthread_cond_wait(&j.cv, &j.mu);
+    pthread_mutex_unlock(&j.mu);
+    offsets[i] = pos;
+    sizes[i] = j.out[i].len;
+    if (j.out[i].len) fwrite(j.out[i].d, 1, j.out[i].len, f);
+    pos += j.out[i].len;
+    free(j.out[i].d);
+    if (pos & 1) { fputc(0, f); pos++; }  // ifd offsets should be even
+    pthread_mutex_lock(&j.mu);
+    j.written++;
+    pthread_cond_broadcast(&j.cv);
+    pthread_mutex_unlock(&j.mu);
+  }
+  for (int i = 0; i < j.threads; ++i) pthread_join(workers[i], NULL);
+  free(workers);
+  pthread_mutex_destroy(&j.mu);
+  pthread_cond_destroy(&j.cv);
+
+  // Classic tiff offsets and counts are longs (4), BigTIFF ones long8s (16).
+  uint16_t off_type = bigtiff ? 16 : 4;
+  if (!bigtiff) {  // narrow in place
+    uint32_t* o32 = (uint32_t*)offsets, *s32 = (uint32_t*)sizes;
+    for (int i = 0; i < j.num_segs; ++i) o32[i] = offsets[i], s32[i] = sizes[i];
+  }
+  int num_entries = o->tile_size ? 12 : 11;
+  int entry_size = bigtiff ? 20 : 12, count_size = bigtiff ? 8 : 2;
+  ifd_pos = pos;
+  uint64_t ext_pos = ifd_pos + count_size + num_entries*entry_size +
+                     (bigtiff ? 8 : 4);
+  struct TiffBuf ifd = { NULL, 0, 0 }, ext = { NULL, 0, 0 };
+  uint64_t n64 = num_entries;
+  uint16_t n16 = num_entries, bps[4] = { 8, 8, 8, 8 }, spp = 4, photo = 2;
+  uint16_t comp = o->compression ? o->compression : kTiffNone, planar = 1;
+  uint16_t extra = 2;  // unpremultiplied alpha
+  uint32_t w32 = w, h32 = h, seg_w = j.seg_w, seg_h = j.seg_h;
+  if (bigtiff) tiffbuf_put(&ifd, &n64, 8); else tiffbuf_put(&ifd, &n16, 2);
+#define ENTRY(tag, type, count, values) \
+  tiff_entry(&ifd, &ext, ext_pos, bigtiff, tag, type, count, values)
+  ENTRY(0x100, 4, 1, &w32);  // width
+  ENTRY(0x101, 4, 1, &h32);  // height
+  ENTRY(0x102, 3, 4, bps);  // bits per sample
+  ENTRY(0x103, 3, 1, &comp);  // compression
+  ENTRY(0x106, 3, 1, &photo);  // photometric interpretation: rgb
+  if (!o->tile_size) ENTRY(0x111, off_type, j.num_segs, offsets);
+  ENTRY(0x115, 3, 1, &spp);  // samples per pixel
+  if (!o->tile_size) {
+    ENTRY(0x116, 4, 1, &seg_h);  // rows per strip
+    ENTRY(0x117, off_type, j.num_segs, sizes);  // strip byte counts
+  }
+  ENTRY(0x11c, 3, 1, &planar);  // planar config: chunky (rgbargba...)
+  if (o->tile_size) {
+    ENTRY(0x142, 4, 1, &seg_w);  // tile width
+    ENTRY(0x143, 4, 1, &seg_h);  // tile length
+    ENTRY(0x144, off_type, j.num_segs, offsets);
+    ENTRY(0x145, off_type, j.num_segs, sizes);  // tile byte counts
+  }
+  ENTRY(0x152, 3, 1, &extra);  // extra samples
+#undef ENTRY
+  uint64_t next_ifd = 0;
+  tiffbuf_put(&ifd, &next_ifd, bigtiff ? 8 : 4);
+  fwrite(ifd.d, 1, ifd.len, f);
+  if (ext.len) fwrite(ext.d, 1, ext.len, f);
+  free(ifd.d); free(ext.d);
+  free(offsets); free(sizes); free(j.out); free(j.done);
+
+  uint32_t ifd_pos32 = ifd_pos;
+  if (fseeko(f, base + (bigtiff ? 8 : 4), SEEK_SET) == 0)
+    fwrite(bigtiff ? (void*)&ifd_pos : &ifd_pos32, bigtiff ? 8 : 4, 1, f);
+  else
+    fprintf(stderr, "wtiff_opt: output not seekable, ifd offset not written\n");
+  fseeko(f, 0, SEEK_END);
+}
+
+// wtiff > out.tif
+// wtiff none|packbits|lzw|deflate [tile size [threads [bigtiff]]] > out.tif
+int main(int argc, char* argv[]) {
   //uint8_t pix[256*125*4];
   //for (size_t i = 0; i < sizeof(pix); ++i) pix[i] = i*i;
   //wtiff(125, 256, pix, stdout);
   uint8_t pix[] = {0xff,0,0,0xff, 0,0xff,0,0xff,  0,0,0xff,0xff, 0xff,0,0,0x80,
                    0,0xff,0,0x60, 0,0,0xff,0x10};
-  wtiff(2, 3, pix, stdout);
+  if (argc < 2) {
+    wtiff(2, 3, pix, stdout);
+    return 0;
+  }
+  struct WtiffOptions o = { kTiffNone, 6, 0, 0, 1, -1 };
+  if (!strcmp(argv[1], "packbits")) o.compression = kTiffPackBits;
+  if (!strcmp(argv[1], "lzw")) o.compression = kTiffLzw;
+  if (!strcmp(argv[1], "deflate")) o.compression = kTiffDeflate;
+  if (argc > 2) o.tile_size = atoi(argv[2]);
+  if (argc > 3) o.threads = atoi(argv[3]);
+  if (argc > 4) o.bigtiff = atoi(argv[4]);
+  wtiff_opt(2, 3, pix, &o, stdout);
 }
 